@@ -1,133 +1,436 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <sys/ipc.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
-#include <assert.h>
-#include <sys/shm.h>		// This is necessary for using shared memory constructs
 #include <semaphore.h>		// This is necessary for using semaphore
 #include <fcntl.h>			// This is necessary for using semaphore
+#include <sched.h>
 #include <pthread.h>        // This is necessary for Pthread          
 #include <string.h>
 #include <math.h>
 #include "utils.h"
-#define VAR_ACCESS_SEMAPHORE "/var_access_semaphore"
+#define DIGIT_BITS 4 // bits of a digit in the packed ring of the cas engine
+#define DIGIT_MASK 0xFUL
+#define DIGITS_PER_WORD 16 // digits in a word of the packed cas ring
+#define LOG_RING_SIZE 262144 // bytes of log text a thread can get ahead of the flusher
+#define PROFILE_BUCKETS 48 // log2 buckets of the time histograms, the last one takes the rest
 
 long int global_var = 0;
 
+// The memory shared by the parent and the child
+typedef struct {
+    sem_t var_access; // guards the shared variable
+    sem_t ready;      // posted once by the parent when the input is published
+    long int value;
+    char digits[]; // the input, however many digits
+} shared_input;
+
+// How the threads update the digits, chosen with -e
+typedef enum {
+    ENGINE_SEM, // a semaphore per digit, both taken in order
+    ENGINE_CAS, // digits packed into words, updated with compare-and-swap
+    ENGINE_FC,  // flat combining: one thread applies everyone's published operations
+    ENGINE_COUNT
+} ring_engine;
+
+const char *engine_names[] = {"sem", "cas", "fc"};
+ring_engine engine = ENGINE_SEM;
+
+// Where the digits live, chosen with -l. Packed digits share cache lines,
+// padded ones have a line each so a write does not invalidate the neighbours.
+typedef enum {
+    LAYOUT_PACKED,
+    LAYOUT_PADDED
+} ring_layout;
+
+const char *layout_names[] = {"packed", "padded"};
+ring_layout layout = LAYOUT_PACKED;
+
+int digit_count = 9; // digits in the ring, -d
+int thread_count = 0; // threads, -t, 0 for one per digit. Thread i works on digits i and i+1 (mod digit_count)
+int batch_size = 1; // operations a thread applies per lock acquisition or compare-and-swap, -b
+
+// How the result is found, chosen with -m
+typedef enum {
+    MODE_RUN,      // run the threads of the engine
+    MODE_ANALYTIC, // compute it directly, it does not depend on the interleaving
+    MODE_VERIFY,   // run the threads and check their result against the analytic one
+    MODE_COUNT
+} run_mode;
+
+const char *mode_names[] = {"run", "analytic", "verify"};
+run_mode mode = MODE_RUN;
+
+// The CPUs the threads are pinned to, chosen with -a. Thread i takes the
+// i-th CPU of the placement, so with compact ring neighbours share caches.
+cpu_placement placement = {NULL, 0};
+
+// Where the contention profile is written as JSON, chosen with -P ("-" for stdout), NULL for none
+const char *profile_path = NULL;
+
+// Where the timeline of the lock waits and holds of the sem engine is written
+// as Chrome trace JSON, chosen with -T ("-" for stdout), NULL for none
+const char *trace_path = NULL;
+
+// Times in nanoseconds, counted in log2 buckets: bucket b holds the
+// times in [2^b, 2^(b+1)), bucket 0 also the times under 1ns.
+typedef struct {
+    long count;
+    long total_ns;
+    long max_ns;
+    long buckets[PROFILE_BUCKETS];
+} time_histogram;
+
+// How long a lock was waited for and held
+typedef struct {
+    time_histogram wait;
+    time_histogram hold;
+} lock_profile;
+
+// What a thread measured, only written by the thread itself and merged at the end
+typedef struct {
+    int digits[2]; // the digits it works on, also the locks it takes in the sem engine
+    lock_profile locks[2];
+    long operations;
+    double seconds;
+} thread_profile;
+
+// What the threads log, chosen with -v. Their lines go through
+// per-thread rings so the operations never wait on stdout.
+log_level verbosity = LOG_OP;
+
+// A digit and its lock, for the sem and fc engines (fc leaves the lock unused)
+typedef struct {
+    sem_t lock;
+    long int value;
+} digit_cell;
+
+// The digits shared by the threads. The sem and fc engines have a
+// digit_cell every <stride> bytes, the cas engine a word of <digits_per_word>
+// digits of 4 bits every <stride> bytes.
+typedef struct {
+    int digit_count;
+    char *memory; // cache line aligned
+    size_t stride;
+    int digits_per_word;
+} digit_ring;
+
+// An operation a thread of the fc engine publishes for the combiner,
+// alone on its cache line so publishing does not disturb the others.
+typedef struct {
+    int pending; // operations waiting to be applied, 0 once the combiner is done
+    int first_digit;
+    int second_digit;
+    int increment;
+    int digit1; // values of the digits before the operations, set by the combiner
+    int digit2;
+} __attribute__((aligned(CACHE_LINE_SIZE))) fc_request;
+
+// The publication list of the fc engine and the lock that makes a thread the combiner.
+typedef struct {
+    fc_request *requests; // one per thread
+    int request_count;
+    int lock;
+} fc_combiner;
+
 // this struct is used to pass parameters to the thread function
 typedef struct {
     int thread_id;
-    sem_t* sem[9];
-    long int *shared_var;
+    digit_ring *ring;
+    fc_combiner *combiner; // fc engine only
+    log_ring *log; // log ring of the thread, unused if verbosity is LOG_OFF
+    thread_profile *profile; // NULL unless profiling
+    trace_buffer *trace; // NULL unless tracing
 } thread_params;
 
 /**
 * This function should be implemented by yourself. It must be invoked
 * in the child process after the input parameter has been obtained.
-* @parms: The input parameter from the terminal.
+* @parms: The input digits from the terminal.
+* @returns: 0, or 1 if the result did not pass verification.
+*/
+int multi_threads_run(const char *input_digits);
+
+/**
+* Adds a time to a histogram.
+* @parms: The histogram and the time in nanoseconds.
 */
-void multi_threads_run(long int input_param);
+void histogramAdd(time_histogram *histogram, long ns);
+
+/**
+* Adds all the times of one histogram to another.
+* @parms: The histogram to add to and the one to add.
+*/
+void histogramMerge(time_histogram *into, const time_histogram *from);
+
+/**
+* Writes a histogram as a JSON object, leaving out the empty buckets.
+* @parms: The output and the histogram.
+*/
+void histogramJson(FILE *output, const time_histogram *histogram);
+
+/**
+* Writes the per-lock and per-thread profile as JSON to profile_path.
+* @parms: The profiles of the threads and their number.
+*/
+void profileWrite(const thread_profile *profiles, int num_of_threads);
+
+/**
+* Runs the threads of the chosen engine on the digits.
+* @parms: The initial digits, the number of threads and where to put the final digits.
+*/
+void concurrentDigits(const int *initial, int num_of_threads, int *final);
+
+/**
+* Computes the final digits without running anything. Every operation
+* adds its thread's increment to both of its digits mod 10, so digit d
+* ends as initial[d] + operations * (sum of the increments of the
+* threads touching d), mod 10, whatever the interleaving.
+* @parms: The initial digits, the number of threads, the operations
+* per thread and where to put the final digits.
+*/
+void analyticDigits(const int *initial, int num_of_threads, long operations, int *final);
 
 // The function define the thread function, which is used to modify the shared variable.
 void* thread_function(void* args);
 
+/**
+* The thread function of the cas engine. Both digits of an operation
+* are updated with a single compare-and-swap when they are in the same
+* word, so no lock is taken and the update rate is only bounded by the
+* word's cache line. Digits in different words are updated one by one.
+* @parms: The thread_params of the thread.
+*/
+void* cas_thread_function(void* args);
+
+/**
+* The thread function of the fc engine. A thread publishes its
+* operations in its request and then either becomes the combiner and
+* applies the requests of all threads in one pass, or waits until
+* another combiner has applied its own.
+* @parms: The thread_params of the thread.
+*/
+void* fc_thread_function(void* args);
+
+/**
+* Applies every published request of the fc engine to the digits.
+* Only called by the thread holding the combiner lock.
+* @parms: The combiner and the digits.
+*/
+void fcCombine(fc_combiner *combiner, digit_ring *ring);
+
+/**
+* Logs the operations of a batch, one line each as if they had been
+* applied one at a time.
+* @parms: The thread's parameters, the digits, their values before the
+* batch, the increment of one operation and the operations in the batch.
+*/
+void logOperations(thread_params *params, int first_digit, int second_digit, int digit1, int digit2, int increment, int count);
+
+/**
+* Adds the increment to one or two digits of a packed word with a
+* compare-and-swap, retrying if another thread changed the word first.
+* @parms: The word, the shifts of the digits (second_shift -1 for a
+* single digit) and the increment.
+* @returns: The word right before the update.
+*/
+uint64_t casAddDigits(uint64_t *word, int first_shift, int second_shift, int increment);
+
+/**
+* Allocates the digits in the chosen layout and sets them.
+* @parms: The ring to set up and the initial digits.
+*/
+void ringCreate(digit_ring *ring, const int *initial);
+
+/**
+* Returns a digit of the ring, once the threads are done.
+* @parms: The ring and the digit index.
+*/
+int ringDigit(digit_ring *ring, int digit);
+
+/**
+* Destroys the locks and frees the digits.
+* @parms: The ring.
+*/
+void ringFree(digit_ring *ring);
+
+/**
+* Returns the cell of a digit for the sem and fc engines.
+*/
+digit_cell *ringCell(digit_ring *ring, int digit);
+
+/**
+* Returns the word holding a digit for the cas engine.
+*/
+uint64_t *ringWord(digit_ring *ring, int digit);
+
 
 int main(int argc, char **argv)
 {
-	int shmid, status;
+	int status;
 	long int local_var = 0;
 	long int *shared_var_p, *shared_var_c;
 
-	if (argc < 2) { 
-		printf("Please enter a nine-digit decimal number and the number of operations as input parameters.\nUsage: ./main <input_param> <num_of_operations>\n");
+	int opt;
+	while ((opt = getopt(argc, argv, "e:v:d:t:l:b:m:a:P:T:")) != -1) {
+		switch (opt) {
+			case 'e':
+				engine = ENGINE_COUNT;
+				for (int e = 0; e < ENGINE_COUNT; ++e) {
+					if (strcmp(optarg, engine_names[e]) == 0) {
+						engine = e;
+					}
+				}
+				if (engine == ENGINE_COUNT) {
+					fprintf(stderr, "Unknown engine %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'v':
+				if (logLevelParse(optarg) < 0) {
+					fprintf(stderr, "Unknown verbosity %s\n", optarg);
+					exit(-1);
+				}
+				verbosity = logLevelParse(optarg);
+				break;
+			case 'd':
+				if (parseNumber(optarg, &digit_count) != 0) {
+					fprintf(stderr, "Invalid number %s for -d\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 't':
+				if (parseNumber(optarg, &thread_count) != 0) {
+					fprintf(stderr, "Invalid number %s for -t\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'b':
+				if (parseNumber(optarg, &batch_size) != 0) {
+					fprintf(stderr, "Invalid number %s for -b\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'P':
+				profile_path = optarg;
+				break;
+			case 'T':
+				trace_path = optarg;
+				break;
+			case 'a':
+				if (placementParse(&placement, optarg) != 0) {
+					fprintf(stderr, "Invalid placement %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'm':
+				mode = MODE_COUNT;
+				for (int m = 0; m < MODE_COUNT; ++m) {
+					if (strcmp(optarg, mode_names[m]) == 0) {
+						mode = m;
+					}
+				}
+				if (mode == MODE_COUNT) {
+					fprintf(stderr, "Unknown mode %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'l':
+				if (strcmp(optarg, layout_names[LAYOUT_PACKED]) == 0) {
+					layout = LAYOUT_PACKED;
+				} else if (strcmp(optarg, layout_names[LAYOUT_PADDED]) == 0) {
+					layout = LAYOUT_PADDED;
+				} else {
+					fprintf(stderr, "Unknown layout %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			default:
+				exit(-1);
+		}
+	}
+
+	if (argc - optind < 2 || digit_count < 2 || thread_count < 0 || batch_size < 1) { 
+		printf("Please enter a nine-digit decimal number and the number of operations as input parameters.\nUsage: ./main [-e sem|cas|fc] [-v off|summary|op] [-d digits] [-t threads] [-l packed|padded] [-b batch_size] [-m run|analytic|verify] [-a none|compact|scatter|<cpu_list>] [-P profile.json] [-T trace.json] <input_param> <num_of_operations>\n");
+		exit(-1);
+	}
+	// Only the sem engine has waits and holds to put on a timeline
+	if (trace_path != NULL && engine != ENGINE_SEM) {
+		fprintf(stderr, "A trace (-T) needs the sem engine, the %s engine records no spans\n", engine_names[engine]);
+		exit(-1);
+	}
+	char *input_arg = argv[optind];
+	if ((int)strlen(input_arg) > digit_count || strspn(input_arg, "0123456789") != strlen(input_arg)) {
+		printf("The input parameter must be a decimal number of at most %d digits.\n", digit_count);
 		exit(-1);
 	}
 	
 	// write the number of operations to gobal variable
-	global_var = strtol(argv[2], NULL, 10);
+	char *operations_end;
+	errno = 0;
+	global_var = strtol(argv[optind + 1], &operations_end, 10);
+	if (errno != 0 || operations_end == argv[optind + 1] || *operations_end != '\0' || global_var < 0) {
+		printf("The number of operations must be a non-negative decimal number.\n");
+		exit(-1);
+	}
+
+	/*
+	    Creating shared memory.
+	    The region is private to this run (see sharedRegionCreate), so
+	    instances running side by side do not share it, and it is
+	    mapped before the fork so the child sees it at the same address.
+	    It holds the semaphores, a long int, then the input digits.
+	*/
+	shared_region region;
+	if (sharedRegionCreate(&region, sizeof(shared_input) + digit_count + 1, 0) != 0) {
+		perror("Shared region create failed");
+		exit(EXIT_FAILURE);
+	}
+	shared_input *shared = region.base;
 
    	/*
 		Creating sem. Mutex semaphore is used to acheive mutual
 		exclusion while processes access (and read or modify) the global
 		variable, local variable, and the shared memory.
-	*/ 
-
-	// Checks if the semaphore exists, if it exists we unlink him from the process.
-	sem_unlink(VAR_ACCESS_SEMAPHORE);
-	
-	// Create the semaphore. sem_init() also creates a semaphore. Learn the difference on your own.
-	sem_t *var_access_semaphore = sem_open(VAR_ACCESS_SEMAPHORE, O_CREAT|O_EXCL, S_IRUSR|S_IWUSR, 1);
-
-	// Check for error while opening the semaphore
-	if (var_access_semaphore != SEM_FAILED){
-		printf("Successfully created new semaphore!\n");
-	}	
-	else if (errno == EEXIST) {   // Semaphore already exists
-		printf("Semaphore appears to exist already!\n");
-		var_access_semaphore = sem_open(VAR_ACCESS_SEMAPHORE, 0);
-	}
-	else {  // An other error occured
-		assert(var_access_semaphore != SEM_FAILED);
-		exit(-1);
-	}
-
-	/*  
-	    Creating shared memory. 
-        The operating system keeps track of the set of shared memory
-	    segments. In order to acquire shared memory, we must first
-	    request the shared memory from the OS using the shmget()
-      	system call. The second parameter specifies the number of
-	    bytes of memory requested. shmget() returns a shared memory
-	    identifier (SHMID) which is an integer. Refer to the online
-	    man pages for details on the other two parameters of shmget()
-	*/
-	// create shared memory to store a long int and an int
-	shmid = shmget(IPC_PRIVATE, sizeof(long int), 0666 | IPC_CREAT);
-
-	/* 
-	    After forking, the parent and child must "attach" the shared
-	    memory to its local data segment. This is done by the shmat()
-	    system call. shmat() takes the SHMID of the shared memory
-	    segment as input parameter and returns the address at which
-	    the segment has been attached. Thus shmat() returns a char
-	    pointer.
+		The ready semaphore starts at 0 and is posted once by the parent when the
+		input is in the shared memory, so the child sleeps until then instead of polling.
 	*/
+	if (sharedSemaphoreInit(&shared->var_access, 1) != 0 || sharedSemaphoreInit(&shared->ready, 0) != 0) {
+		perror("Semaphore init failed");
+		exit(EXIT_FAILURE);
+	}
+	printf("Successfully created new semaphore!\n");
+	sem_t *var_access_semaphore = &shared->var_access;
+	sem_t *ready_semaphore = &shared->ready;
 
 	if (fork() == 0) { // Child Process 
         
 		printf("Child Process: Child PID is %jd\n", (intmax_t) getpid());
 		
-		/*  shmat() returns a long int pointer which is typecast here
-		    to long int and the address is stored in the long int pointer shared_var_c. */
-        shared_var_c = (long int *) shmat(shmid, 0, 0);
-
-		while (1) // Loop to check if the variables have been updated.
-		{
-			// Get the semaphore
-			sem_wait(var_access_semaphore);
-			printf("Child Process: Got the variable access semaphore.\n");
-
-			if ( (global_var != 0) || (local_var != 0) || (shared_var_c[0] != 0) )
-			{
-				printf("Child Process: Read the global variable with value of %ld.\n", global_var);
-				printf("Child Process: Read the local variable with value of %ld.\n", local_var);
-				printf("Child Process: Read the shared variable with value of %ld.\n", shared_var_c[0]);
-
-                // Release the semaphore
-                sem_post(var_access_semaphore);
-                printf("Child Process: Released the variable access semaphore.\n");
-                
-				break;
-			}
+		// The shared variable sits right after the semaphores
+        shared_var_c = &shared->value;
 
-			// Release the semaphore
-			sem_post(var_access_semaphore);
-			printf("Child Process: Released the variable access semaphore.\n");
+		// Block until the parent has published the input, retrying if a signal interrupts the wait.
+		while (sem_wait(ready_semaphore) == -1) {
+			if (errno != EINTR) {
+				perror("Ready semaphore wait failed");
+				exit(EXIT_FAILURE);
+			}
 		}
 
+		// Get the semaphore
+		sem_wait(var_access_semaphore);
+		printf("Child Process: Got the variable access semaphore.\n");
+		printf("Child Process: Read the global variable with value of %ld.\n", global_var);
+		printf("Child Process: Read the local variable with value of %ld.\n", local_var);
+		printf("Child Process: Read the shared variable with value of %ld.\n", shared_var_c[0]);
+
+		// Release the semaphore
+		sem_post(var_access_semaphore);
+		printf("Child Process: Released the variable access semaphore.\n");
+
         /**
          * After you have fixed the issue in Problem 1-Q1, 
          * uncomment the following multi_threads_run function 
@@ -136,61 +439,53 @@ int main(int argc, char **argv)
          * which can be obtained from one of the three variables,
          * i.e., global_var, local_var, shared_var_c[0].
          */
-		multi_threads_run(shared_var_c[0]);
+		int run_status = multi_threads_run(shared->digits);
 
-		/* each process should "detach" itself from the 
+		/* each process should unmap the
 		   shared memory after it is used */
 
-		shmdt(shared_var_c);
+		sharedRegionDestroy(&region);
 
-		exit(0);
+		exit(run_status);
 	}
 	else { // Parent Process
 
 		printf("Parent Process: Parent PID is %jd\n", (intmax_t) getpid());
 
-		/*  shmat() returns a long int pointer which is typecast here
-		    to long int and the address is stored in the long int pointer shared_var_p.
-		    Thus the memory location shared_var_p[0] of the parent
+		/*  The memory location shared_var_p[0] of the parent
 		    is the same as the memory locations shared_var_c[0] of
 		    the child, since the memory is shared.
 		*/
-		shared_var_p = (long int *) shmat(shmid, 0, 0);
+		shared_var_p = &shared->value;
 
 		// Get the semaphore first
 		sem_wait(var_access_semaphore);
 		printf("Parent Process: Got the variable access semaphore.\n");
 
-		global_var = strtol(argv[1], NULL, 10);
-		local_var = strtol(argv[1], NULL, 10);
-		shared_var_p[0] = strtol(argv[1], NULL, 10);
+		global_var = strtol(input_arg, NULL, 10);
+		local_var = strtol(input_arg, NULL, 10);
+		shared_var_p[0] = strtol(input_arg, NULL, 10);
+		strcpy(shared->digits, input_arg); // all the digits, however many
 
 		// Release the semaphore
 		sem_post(var_access_semaphore);
 		printf("Parent Process: Released the variable access semaphore.\n");
-        
-		wait(&status);
-
-		/* each process should "detach" itself from the 
-		   shared memory after it is used */
 
-		shmdt(shared_var_p);
+		// Wake the child, the input is published
+		sem_post(ready_semaphore);
 
-		/* Child has exited, so parent process should delete
-		   the cretaed shared memory. Unlike attach and detach,
-		   which is to be done for each process separately,
-		   deleting the shared memory has to be done by only
-		   one process after making sure that noone else
-		   will be using it 
-		 */
+		wait(&status);
 
-		shmctl(shmid, IPC_RMID, 0);
+		/* Child has exited, so nobody else uses the semaphores and
+		   the shared memory, which is freed once unmapped here */
 
-        // Close and delete semaphore. 
-        sem_close(var_access_semaphore);
-        sem_unlink(VAR_ACCESS_SEMAPHORE);
+        sem_destroy(var_access_semaphore);
+        sem_destroy(ready_semaphore);
+		sharedRegionDestroy(&region);
+        placementFree(&placement);
 
-		exit(0);
+		// pass on a failed verification in the child
+		exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
 	}
 
 	exit(0);
@@ -199,112 +494,569 @@ int main(int argc, char **argv)
 void* thread_function(void* args) {
     thread_params* params = (thread_params*)args;
     int thread_id = params->thread_id;
-	int num_of_operations = global_var;
-	printf("Ready: Thread %d\n", thread_id+1);
-	//printf("num_of_operations: %d\n", num_of_operations);
-    int first_digit = thread_id;
-    int second_digit = (thread_id + 1) % 9;
+    digit_ring *ring = params->ring;
+	long num_of_operations = global_var;
+	long start_ns = params->profile != NULL ? traceClock() : 0;
+	if (verbosity >= LOG_SUMMARY) {
+		logWrite(params->log, "Ready: Thread %d\n", thread_id+1);
+	}
+	//printf("num_of_operations: %ld\n", num_of_operations);
+    int first_digit = thread_id % ring->digit_count;
+    int second_digit = (first_digit + 1) % ring->digit_count;
+    digit_cell *first_cell = ringCell(ring, first_digit);
+    digit_cell *second_cell = ringCell(ring, second_digit);
 	// use Consistent Lock Ordering to avoid deadlock
-	int first_sem = (first_digit < second_digit) ? first_digit : second_digit;
-    int second_sem = (first_digit < second_digit) ? second_digit : first_digit;
+	sem_t *first_sem = (first_digit < second_digit) ? &first_cell->lock : &second_cell->lock;
+    sem_t *second_sem = (first_digit < second_digit) ? &second_cell->lock : &first_cell->lock;
+
+    // calculate increment
+    //int increment = (thread_id + 1) & (digit1 + digit2);
+    int increment = (thread_id + 1);
+    int timed = params->profile != NULL || params->trace != NULL;
 
-    for (int i = 0; i < num_of_operations; ++i) { 
-        // lock 2 sem
-        sem_wait(params->sem[first_sem]);
-        sem_wait(params->sem[second_sem]);
+    for (long i = 0, count; i < num_of_operations; i += count) { 
+        // the operations of a batch add up, so they are applied as one
+        count = num_of_operations - i < batch_size ? num_of_operations - i : batch_size;
+        int batch_increment = (long)count * increment % 10;
+
+        // lock 2 sem, timing the waits when profiling or tracing
+        long wait_ns = timed ? traceClock() : 0;
+        sem_wait(first_sem);
+        long first_held_ns = timed ? traceClock() : 0;
+        sem_wait(second_sem);
+        long second_held_ns = timed ? traceClock() : 0;
 		//printf("Thread %d: Started\n", thread_id+1);
 
         // read the two digits
-		int digit1 = params->shared_var[first_digit];
-		int digit2 = params->shared_var[second_digit];
-		
-		int prev_digit1 = digit1;
-		int prev_digit2 = digit2;
+		int digit1 = first_cell->value;
+		int digit2 = second_cell->value;
 
-		// calculate increment
-		//int increment = (thread_id + 1) & (digit1 + digit2);
-		int increment = (thread_id + 1);
+		// write the two digits back, updated
+		first_cell->value = (digit1 + batch_increment) % 10;
+		second_cell->value = (digit2 + batch_increment) % 10;
 
-		// update the two digits
-		digit1 = (digit1 + increment) % 10;
-		digit2 = (digit2 + increment) % 10;
+        // unlock 2 sem
+        sem_post(first_sem);
+        sem_post(second_sem);
 
-		// write the two digits back
-		params->shared_var[first_digit] = digit1;
-		params->shared_var[second_digit] = digit2;
+        long released_ns = timed ? traceClock() : 0;
+        if (params->trace != NULL) {
+            traceSpan(params->trace, "wait", wait_ns, second_held_ns);
+            traceSpan(params->trace, "hold", second_held_ns, released_ns);
+        }
+        if (params->profile != NULL) {
+            // locks[0] is the lock of the lower digit, taken first
+            histogramAdd(&params->profile->locks[0].wait, first_held_ns - wait_ns);
+            histogramAdd(&params->profile->locks[1].wait, second_held_ns - first_held_ns);
+            histogramAdd(&params->profile->locks[0].hold, released_ns - first_held_ns);
+            histogramAdd(&params->profile->locks[1].hold, released_ns - second_held_ns);
+        }
 
-        printf("Thread %d: Modified digits[%d] and digits[%d] from %d and %d to %d and %d\n", thread_id+1, first_digit+1, second_digit+1, prev_digit1, prev_digit2, digit1, digit2);
+        // logged after unlocking, the values are the thread's own copies
+        if (verbosity >= LOG_OP) {
+            logOperations(params, first_digit, second_digit, digit1, digit2, increment, count);
+        }
+    }
 
-        // unlock 2 sem
-        sem_post(params->sem[first_sem]);
-        sem_post(params->sem[second_sem]);
+    if (verbosity >= LOG_SUMMARY) {
+        logWrite(params->log, "Thread %d: Done %ld operations\n", thread_id+1, num_of_operations);
+    }
+    if (params->profile != NULL) {
+        params->profile->operations = num_of_operations;
+        params->profile->seconds = (traceClock() - start_ns) / 1e9;
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+* The thread function of the cas engine. Both digits of an operation
+* are updated with a single compare-and-swap when they are in the same
+* word, so no lock is taken and the update rate is only bounded by the
+* word's cache line. Digits in different words are updated one by one.
+* @parms: The thread_params of the thread.
+*/
+void* cas_thread_function(void* args) {
+    thread_params* params = (thread_params*)args;
+    int thread_id = params->thread_id;
+    digit_ring *ring = params->ring;
+	long num_of_operations = global_var;
+	long start_ns = params->profile != NULL ? traceClock() : 0;
+	if (verbosity >= LOG_SUMMARY) {
+		logWrite(params->log, "Ready: Thread %d\n", thread_id+1);
+	}
+    int first_digit = thread_id % ring->digit_count;
+    int second_digit = (first_digit + 1) % ring->digit_count;
+    uint64_t *first_word = ringWord(ring, first_digit);
+    uint64_t *second_word = ringWord(ring, second_digit);
+    int first_shift = (first_digit % ring->digits_per_word) * DIGIT_BITS;
+    int second_shift = (second_digit % ring->digits_per_word) * DIGIT_BITS;
+	int increment = (thread_id + 1);
+
+    for (long i = 0, count; i < num_of_operations; i += count) {
+        count = num_of_operations - i < batch_size ? num_of_operations - i : batch_size;
+        int batch_increment = (long)count * increment % 10;
+		int digit1, digit2;
+		if (first_word == second_word) {
+			uint64_t old_ring = casAddDigits(first_word, first_shift, second_shift, batch_increment);
+			digit1 = (old_ring >> first_shift) & DIGIT_MASK;
+			digit2 = (old_ring >> second_shift) & DIGIT_MASK;
+		} else {
+			digit1 = (casAddDigits(first_word, first_shift, -1, batch_increment) >> first_shift) & DIGIT_MASK;
+			digit2 = (casAddDigits(second_word, second_shift, -1, batch_increment) >> second_shift) & DIGIT_MASK;
+		}
+
+        if (verbosity >= LOG_OP) {
+            logOperations(params, first_digit, second_digit, digit1, digit2, increment, count);
+        }
+    }
+
+    if (verbosity >= LOG_SUMMARY) {
+        logWrite(params->log, "Thread %d: Done %ld operations\n", thread_id+1, num_of_operations);
+    }
+    if (params->profile != NULL) {
+        params->profile->operations = num_of_operations;
+        params->profile->seconds = (traceClock() - start_ns) / 1e9;
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+* The thread function of the fc engine. A thread publishes its
+* operations in its request and then either becomes the combiner and
+* applies the requests of all threads in one pass, or waits until
+* another combiner has applied its own.
+* @parms: The thread_params of the thread.
+*/
+void* fc_thread_function(void* args) {
+    thread_params* params = (thread_params*)args;
+    int thread_id = params->thread_id;
+    fc_combiner *combiner = params->combiner;
+    fc_request *request = &combiner->requests[thread_id];
+	long num_of_operations = global_var;
+	long start_ns = params->profile != NULL ? traceClock() : 0;
+	if (verbosity >= LOG_SUMMARY) {
+		logWrite(params->log, "Ready: Thread %d\n", thread_id+1);
+	}
+    request->first_digit = thread_id % params->ring->digit_count;
+    request->second_digit = (request->first_digit + 1) % params->ring->digit_count;
+    request->increment = (thread_id + 1);
+
+    for (long i = 0, count; i < num_of_operations; i += count) {
+        count = num_of_operations - i < batch_size ? num_of_operations - i : batch_size;
+        __atomic_store_n(&request->pending, count, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&request->pending, __ATOMIC_ACQUIRE) != 0) {
+            if (!__atomic_exchange_n(&combiner->lock, 1, __ATOMIC_ACQUIRE)) {
+                fcCombine(combiner, params->ring);
+                __atomic_store_n(&combiner->lock, 0, __ATOMIC_RELEASE);
+            } else {
+                sched_yield(); // let the combiner run
+            }
+        }
+
+        if (verbosity >= LOG_OP) {
+            logOperations(params, request->first_digit, request->second_digit, request->digit1, request->digit2, request->increment, count);
+        }
+    }
+
+    if (verbosity >= LOG_SUMMARY) {
+        logWrite(params->log, "Thread %d: Done %ld operations\n", thread_id+1, num_of_operations);
+    }
+    if (params->profile != NULL) {
+        params->profile->operations = num_of_operations;
+        params->profile->seconds = (traceClock() - start_ns) / 1e9;
     }
 
     pthread_exit(NULL);
 }
+
+/**
+* Applies every published request of the fc engine to the digits.
+* Only called by the thread holding the combiner lock.
+* @parms: The combiner and the digits.
+*/
+void fcCombine(fc_combiner *combiner, digit_ring *ring) {
+	for (int i = 0; i < combiner->request_count; ++i) {
+		fc_request *request = &combiner->requests[i];
+		int count = __atomic_load_n(&request->pending, __ATOMIC_ACQUIRE);
+		if (count == 0) {
+			continue;
+		}
+		int batch_increment = (long)count * request->increment % 10;
+		digit_cell *first_cell = ringCell(ring, request->first_digit);
+		digit_cell *second_cell = ringCell(ring, request->second_digit);
+		request->digit1 = first_cell->value;
+		request->digit2 = second_cell->value;
+		first_cell->value = (request->digit1 + batch_increment) % 10;
+		second_cell->value = (request->digit2 + batch_increment) % 10;
+		__atomic_store_n(&request->pending, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+* Logs the operations of a batch, one line each as if they had been
+* applied one at a time.
+* @parms: The thread's parameters, the digits, their values before the
+* batch, the increment of one operation and the operations in the batch.
+*/
+void logOperations(thread_params *params, int first_digit, int second_digit, int digit1, int digit2, int increment, int count) {
+	for (int j = 0; j < count; ++j) {
+		int next1 = (digit1 + increment) % 10;
+		int next2 = (digit2 + increment) % 10;
+		logWrite(params->log, "Thread %d: Modified digits[%d] and digits[%d] from %d and %d to %d and %d\n", params->thread_id+1, first_digit+1, second_digit+1, digit1, digit2, next1, next2);
+		digit1 = next1;
+		digit2 = next2;
+	}
+}
+
+/**
+* Adds the increment to one or two digits of a packed word with a
+* compare-and-swap, retrying if another thread changed the word first.
+* @parms: The word, the shifts of the digits (second_shift -1 for a
+* single digit) and the increment.
+* @returns: The word right before the update.
+*/
+uint64_t casAddDigits(uint64_t *word, int first_shift, int second_shift, int increment) {
+	uint64_t old_word = __atomic_load_n(word, __ATOMIC_RELAXED);
+	uint64_t new_word;
+	do {
+		// update the digits in a copy of the word
+		uint64_t digit1 = (old_word >> first_shift) & DIGIT_MASK;
+		new_word = (old_word & ~(DIGIT_MASK << first_shift)) | (((digit1 + increment) % 10) << first_shift);
+		if (second_shift >= 0) {
+			uint64_t digit2 = (old_word >> second_shift) & DIGIT_MASK;
+			new_word = (new_word & ~(DIGIT_MASK << second_shift)) | (((digit2 + increment) % 10) << second_shift);
+		}
+	} while (!__atomic_compare_exchange_n(word, &old_word, new_word, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return old_word;
+}
+
+/**
+* Allocates the digits in the chosen layout and sets them.
+* @parms: The ring to set up and the initial digits.
+*/
+void ringCreate(digit_ring *ring, const int *initial) {
+	ring->digit_count = digit_count;
+	if (engine == ENGINE_CAS) {
+		ring->digits_per_word = layout == LAYOUT_PADDED ? 1 : DIGITS_PER_WORD;
+		ring->stride = layout == LAYOUT_PADDED ? CACHE_LINE_SIZE : sizeof(uint64_t);
+	} else {
+		ring->digits_per_word = 1;
+		ring->stride = layout == LAYOUT_PADDED ? CACHE_LINE_SIZE : sizeof(digit_cell);
+	}
+	int slots = (digit_count + ring->digits_per_word - 1) / ring->digits_per_word;
+	size_t size = (slots * ring->stride + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+	ring->memory = aligned_alloc(CACHE_LINE_SIZE, size);
+	if (ring->memory == NULL) {
+		perror("Digit ring allocation failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(ring->memory, 0, size);
+
+	for (int i = 0; i < digit_count; ++i) {
+		int digit = initial[i];
+		if (engine == ENGINE_CAS) {
+			*ringWord(ring, i) |= (uint64_t)digit << ((i % ring->digits_per_word) * DIGIT_BITS);
+		} else {
+			ringCell(ring, i)->value = digit;
+			if (engine == ENGINE_SEM) {
+				sem_init(&ringCell(ring, i)->lock, 0, 1);
+			}
+		}
+	}
+}
+
+/**
+* Returns a digit of the ring, once the threads are done.
+* @parms: The ring and the digit index.
+*/
+int ringDigit(digit_ring *ring, int digit) {
+	if (engine == ENGINE_CAS) {
+		return (*ringWord(ring, digit) >> ((digit % ring->digits_per_word) * DIGIT_BITS)) & DIGIT_MASK;
+	}
+	return ringCell(ring, digit)->value;
+}
+
+/**
+* Destroys the locks and frees the digits.
+* @parms: The ring.
+*/
+void ringFree(digit_ring *ring) {
+	for (int i = 0; i < ring->digit_count && engine == ENGINE_SEM; ++i) {
+		sem_destroy(&ringCell(ring, i)->lock);
+	}
+	free(ring->memory);
+}
+
+/**
+* Returns the cell of a digit for the sem and fc engines.
+*/
+digit_cell *ringCell(digit_ring *ring, int digit) {
+	return (digit_cell *)(ring->memory + digit * ring->stride);
+}
+
+/**
+* Returns the word holding a digit for the cas engine.
+*/
+uint64_t *ringWord(digit_ring *ring, int digit) {
+	return (uint64_t *)(ring->memory + digit / ring->digits_per_word * ring->stride);
+}
+
 /**
 * This function should be implemented by yourself. It must be invoked
 * in the child process after the input parameter has been obtained.
-* @parms: The input parameter from terminal.
+* @parms: The input digits from terminal.
+* @returns: 0, or 1 if the result did not pass verification.
 */
-void multi_threads_run(long int input_param)
+int multi_threads_run(const char *input_digits)
 {
-	pthread_t threads[9];
-    sem_t* sem[9];
-    thread_params params[9];
-    long int shared_var[9];
-
-    // initialize shared_var
-    for (int i = 0; i < 9; ++i) {
-        shared_var[i] = (input_param / (long int)pow(10, 9 - 1 - i)) % 10;
-		printf("shared_var[%d]: %ld\n", i, shared_var[i]);
-    }
-
-    // create sem
-    for (int i = 0; i < 9; ++i) {
-        char sem_name[20];
-		sprintf(sem_name, "/sem_%d", i); // create a unique name for the semaphore
-		sem_unlink(sem_name);            //guarantees that the semaphore is destroyed when the program exits
-		sem[i] = sem_open(sem_name, O_CREAT, 0644, 1);
-		if (sem[i] == SEM_FAILED) {
-			perror("sem_open failed");
-			exit(EXIT_FAILURE);
-		}
+    int num_of_threads = thread_count > 0 ? thread_count : digit_count;
+    int *initial = malloc(digit_count * sizeof(int));
+    int *final = malloc(digit_count * sizeof(int));
+    int run_status = 0;
+
+    // initialize the digits, the input is padded with leading zeros
+    int padding = digit_count - (int)strlen(input_digits);
+    for (int i = 0; i < digit_count; ++i) {
+        initial[i] = i < padding ? 0 : input_digits[i - padding] - '0';
+		printf("shared_var[%d]: %d\n", i, initial[i]);
+    }
+
+    if (mode == MODE_ANALYTIC) {
+        analyticDigits(initial, num_of_threads, global_var, final);
+    } else {
+        concurrentDigits(initial, num_of_threads, final);
+    }
+
+    if (mode == MODE_VERIFY) {
+        int *expected = malloc(digit_count * sizeof(int));
+        analyticDigits(initial, num_of_threads, global_var, expected);
+        for (int i = 0; i < digit_count; ++i) {
+            if (final[i] != expected[i]) {
+                fprintf(stderr, "Verify: digits[%d] is %d, expected %d\n", i+1, final[i], expected[i]);
+                run_status = 1;
+            }
+        }
+        printf("Verify: %s\n", run_status == 0 ? "passed" : "FAILED");
+        free(expected);
+    }
+
+    // output the final result, as a number without its leading zeros
+    char *result = malloc(digit_count + 1);
+    for (int i = 0; i < digit_count; ++i) {
+        result[i] = '0' + final[i];
+    }
+    result[digit_count] = '\0';
+    char *number = result;
+    while (number[0] == '0' && number[1] != '\0') {
+        number++;
+    }
+	// call the function to save the result to a file
+    saveResultString("p1_result.txt", number);
+    // printf("Final result saved to p1_result.txt\n");
+    printf("Final result: %s\n", number);
+
+    free(result);
+    free(final);
+    free(initial);
+    return run_status;
+}
+
+/**
+* Runs the threads of the chosen engine on the digits.
+* @parms: The initial digits, the number of threads and where to put the final digits.
+*/
+void concurrentDigits(const int *initial, int num_of_threads, int *final)
+{
+	pthread_t *threads = malloc(num_of_threads * sizeof(pthread_t));
+    thread_params *params = malloc(num_of_threads * sizeof(thread_params));
+    thread_profile *profiles = profile_path != NULL ? calloc(num_of_threads, sizeof(thread_profile)) : NULL;
+    trace_log trace;
+    if (trace_path != NULL) {
+        traceStart(&trace, num_of_threads);
+    }
+    digit_ring ring;
+    ringCreate(&ring, initial);
+
+    fc_combiner combiner = {NULL, num_of_threads, 0};
+    if (engine == ENGINE_FC) {
+        combiner.requests = aligned_alloc(CACHE_LINE_SIZE, num_of_threads * sizeof(fc_request));
+        memset(combiner.requests, 0, num_of_threads * sizeof(fc_request));
+    }
+
+    log_flusher flusher;
+    if (verbosity > LOG_OFF) {
+        fflush(stdout);
+        logStart(&flusher, num_of_threads, LOG_RING_SIZE, stdout);
     }
 
     // create threads
-    for (int i = 0; i < 9; ++i) {
+    for (int i = 0; i < num_of_threads; ++i) {
         params[i].thread_id = i;
-        params[i].shared_var = shared_var;
-        memcpy(params[i].sem, sem, sizeof(sem));// pass the sem to the thread function
-        pthread_create(&threads[i], NULL, thread_function, (void*)&params[i]);
+        params[i].log = verbosity > LOG_OFF ? &flusher.rings[i] : NULL;
+        params[i].ring = &ring;
+        params[i].combiner = &combiner;
+        params[i].profile = profiles != NULL ? &profiles[i] : NULL;
+        params[i].trace = trace_path != NULL ? &trace.buffers[i] : NULL;
+        if (profiles != NULL) {
+            int first_digit = i % digit_count;
+            int second_digit = (first_digit + 1) % digit_count;
+            profiles[i].digits[0] = first_digit < second_digit ? first_digit : second_digit;
+            profiles[i].digits[1] = first_digit < second_digit ? second_digit : first_digit;
+        }
+        void *(*function)(void *) = engine == ENGINE_CAS ? cas_thread_function : engine == ENGINE_FC ? fc_thread_function : thread_function;
+        pthread_attr_t attr;
+        placementAttr(&placement, i, &attr);
+        pthread_create(&threads[i], &attr, function, (void*)&params[i]);
+        pthread_attr_destroy(&attr);
     }
 
     // wait for threads to finish
-    for (int i = 0; i < 9; ++i) {
+    for (int i = 0; i < num_of_threads; ++i) {
         pthread_join(threads[i], NULL);
     }
-	
-	// for (int i = 0; i < 9; ++i) {
-    //     printf("Final shared_var[%d]: %ld\n", i+1, shared_var[i]);
-    // }
+    if (verbosity > LOG_OFF) {
+        logStop(&flusher);
+    }
 
-    // output the final result
-    long int result = 0;
-    for (int i = 0; i < 9; ++i) {
-        result = result * 10 + shared_var[i];
+    for (int i = 0; i < digit_count; ++i) {
+        final[i] = ringDigit(&ring, i);
+    }
+    if (profiles != NULL) {
+        profileWrite(profiles, num_of_threads);
+        free(profiles);
+    }
+    if (trace_path != NULL) {
+        if (traceWrite(&trace, trace_path) != 0) {
+            perror("Trace open failed");
+        }
+        traceFree(&trace);
     }
-	// call the function to save the result to a file
-    saveResult("p1_result.txt", result);
-    // printf("Final result saved to p1_result.txt\n");
-    printf("Final result: %ld\n", result);
 
-    // close and unlink sem
-    for (int i = 0; i < 9; ++i) {
-        sem_close(sem[i]);
-        char sem_name[20];
-        sprintf(sem_name, "sem_%d", i);
-        sem_unlink(sem_name);
+    ringFree(&ring);
+    free(combiner.requests);
+    free(params);
+    free(threads);
+}
+
+/**
+* Computes the final digits without running anything. Every operation
+* adds its thread's increment to both of its digits mod 10, so digit d
+* ends as initial[d] + operations * (sum of the increments of the
+* threads touching d), mod 10, whatever the interleaving.
+* @parms: The initial digits, the number of threads, the operations
+* per thread and where to put the final digits.
+*/
+void analyticDigits(const int *initial, int num_of_threads, long operations, int *final)
+{
+    int *increments = calloc(digit_count, sizeof(int)); // mod 10
+    for (int t = 0; t < num_of_threads; ++t) {
+        int first_digit = t % digit_count;
+        int second_digit = (first_digit + 1) % digit_count;
+        increments[first_digit] = (increments[first_digit] + t + 1) % 10;
+        increments[second_digit] = (increments[second_digit] + t + 1) % 10;
+    }
+    for (int i = 0; i < digit_count; ++i) {
+        final[i] = (initial[i] + operations % 10 * increments[i]) % 10;
     }
+    free(increments);
+}
+
+/**
+* Adds a time to a histogram.
+* @parms: The histogram and the time in nanoseconds.
+*/
+void histogramAdd(time_histogram *histogram, long ns)
+{
+    int bucket = ns > 1 ? 63 - __builtin_clzl(ns) : 0;
+    histogram->buckets[bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1]++;
+    histogram->count++;
+    histogram->total_ns += ns;
+    if (ns > histogram->max_ns) {
+        histogram->max_ns = ns;
+    }
+}
 
+/**
+* Adds all the times of one histogram to another.
+* @parms: The histogram to add to and the one to add.
+*/
+void histogramMerge(time_histogram *into, const time_histogram *from)
+{
+    into->count += from->count;
+    into->total_ns += from->total_ns;
+    if (from->max_ns > into->max_ns) {
+        into->max_ns = from->max_ns;
+    }
+    for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+        into->buckets[b] += from->buckets[b];
+    }
+}
+
+/**
+* Writes a histogram as a JSON object, leaving out the empty buckets.
+* @parms: The output and the histogram.
+*/
+void histogramJson(FILE *output, const time_histogram *histogram)
+{
+    fprintf(output, "{\"total_ns\": %ld, \"mean_ns\": %.1f, \"max_ns\": %ld, \"buckets\": [",
+        histogram->total_ns, histogram->count > 0 ? (double)histogram->total_ns / histogram->count : 0.0, histogram->max_ns);
+    const char *separator = "";
+    for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+        if (histogram->buckets[b] > 0) {
+            fprintf(output, "%s{\"from_ns\": %ld, \"count\": %ld}", separator, b == 0 ? 0L : 1L << b, histogram->buckets[b]);
+            separator = ", ";
+        }
+    }
+    fprintf(output, "]}");
+}
+
+/**
+* Writes the per-lock and per-thread profile as JSON to profile_path.
+* @parms: The profiles of the threads and their number.
+*/
+void profileWrite(const thread_profile *profiles, int num_of_threads)
+{
+    FILE *output = strcmp(profile_path, "-") == 0 ? stdout : fopen(profile_path, "w");
+    if (output == NULL) {
+        perror("Profile open failed");
+        return;
+    }
+
+    // Merge what the threads saw of each lock, only the sem engine has locks
+    lock_profile *locks = calloc(digit_count, sizeof(lock_profile));
+    for (int t = 0; t < num_of_threads && engine == ENGINE_SEM; ++t) {
+        for (int l = 0; l < 2; ++l) {
+            histogramMerge(&locks[profiles[t].digits[l]].wait, &profiles[t].locks[l].wait);
+            histogramMerge(&locks[profiles[t].digits[l]].hold, &profiles[t].locks[l].hold);
+        }
+    }
+
+    fprintf(output, "{\n  \"engine\": \"%s\", \"layout\": \"%s\", \"digits\": %d, \"thread_count\": %d, \"batch\": %d,\n",
+        engine_names[engine], layout_names[layout], digit_count, num_of_threads, batch_size);
+    fprintf(output, "  \"locks\": [");
+    for (int i = 0; i < digit_count && engine == ENGINE_SEM; ++i) {
+        fprintf(output, "%s\n    {\"lock\": %d, \"acquires\": %ld,\n     \"wait\": ", i > 0 ? "," : "", i+1, locks[i].wait.count);
+        histogramJson(output, &locks[i].wait);
+        fprintf(output, ",\n     \"hold\": ");
+        histogramJson(output, &locks[i].hold);
+        fprintf(output, "}");
+    }
+    fprintf(output, "\n  ],\n  \"threads\": [");
+    for (int t = 0; t < num_of_threads; ++t) {
+        const thread_profile *profile = &profiles[t];
+        fprintf(output, "%s\n    {\"thread\": %d, \"digits\": [%d, %d], \"operations\": %ld, \"seconds\": %.6f, \"ops_per_s\": %.0f}",
+            t > 0 ? "," : "", t+1, profile->digits[0]+1, profile->digits[1]+1, profile->operations, profile->seconds,
+            profile->seconds > 0 ? profile->operations / profile->seconds : 0.0);
+    }
+    fprintf(output, "\n  ]\n}\n");
+
+    free(locks);
+    if (output != stdout) {
+        fclose(output);
+    } else {
+        fflush(output);
+    }
 }
@@ -8,280 +8,1474 @@
 #include <sys/stat.h>
 #include <semaphore.h>
 #include <pthread.h>
-#include <sys/shm.h>
 #include <errno.h>
 #include <assert.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "utils.h"
 
 #define SHM_SIZE 1048576 // 1MB buffer size for shared memory
-#define MAX_FILES 100 // Maximum number of text files
-#define VAR_WRITE_SEMAPHORE "/write_semaphore"
-#define VAR_READ_SEMAPHORE "/read_semaphore"
+#define DEFAULT_SLOT_COUNT 4 // Number of slots in the shared memory ring
+#define DEFAULT_MIN_LONG_LENGTH 6 // Words with at least this many chars count in math files
+#define DIR_QUEUE_LIMIT 64 // Directories queued for other walkers, deeper ones are walked in place
+#define PATH_BLOCK_SIZE 65536 // Size of a block of the path arena
+#define FILE_QUEUE_FACTOR 4 // Opened files waiting for the readers, per outstanding read
+#define MAX_READER_THREADS 64 // Reader threads of the thread pool backend, whatever the read ahead
+#define URING_PROBE_OPS 256 // Opcodes asked about when probing io_uring
+#define MIN_RECORD_DATA 4096 // A part of a file is only packed after others if it gets this many chars
+#define RECORD_ALIGN(size) (((size) + 7) & ~7L) // Records in a slot start on 8 byte boundaries
 
-// Global variables to store file paths
-char *file_paths[MAX_FILES];
-int file_count = 0;
+// The two slot queues of the ring
+#define FULL_QUEUE 0 // filled by the parent, drained by the workers
+#define FREE_QUEUE 1 // released by the workers, refilled by the parent
 
-int countLongWords(char *text);
+// write_semaphore counts the free slots, read_semaphore the full ones
+// and ring_semaphore guards the queue indices. They live in the ring header.
+sem_t *write_semaphore, *read_semaphore, *ring_semaphore;
+
+// Starts every slot of the ring and is followed by <record_count>
+// records, so one handoff can carry many small files.
+typedef struct {
+	int record_count;
+	int stop; // tells the worker to stop
+} slot_header;
+
+// Header of every record in a slot. In copy mode the record holds
+// <length> chars of the file right after the header, in mmap mode it
+// holds the path of the file and the worker maps that part of the
+// file by itself, so no file content goes through shared memory.
+typedef struct {
+	int file_index; // numbered as found
+	long offset;
+	long length;
+	int end_of_file; // last chunk of the file
+	word_counter entry; // counter state right before the chunk (copy mode)
+	long next; // where the next record starts, from the slot header
+} chunk_desc;
+
+// The slot a parent thread is packing records into.
+typedef struct {
+	int slot; // -1 if none
+	long used; // bytes used, from the slot header on
+	int *pending; // io_uring only: reads in flight per slot, the slot is sent when they are done
+	char *sealed; // io_uring only: slots which are full and wait for their reads
+} slot_packer;
+
+// A queue of slot indices, its entries live in the shared memory too.
+typedef struct {
+	int head; // next position to put a slot
+	int tail; // next position to get a slot
+	long offset; // where the entries start, from the ring header
+} slot_queue;
+
+// Lives at the start of the shared memory, followed by the queue
+// entries, the worker results and the slots. Slots are handed back in
+// any order when there are several workers, so free slots go through
+// a queue of their own instead of just following the full ones.
+typedef struct {
+	int slot_count;
+	long slot_size;
+	long slot_stride;
+	long slots_offset;
+	int worker_count;
+	long results_offset;
+	slot_queue queues[2];
+	sem_t write_semaphore;
+	sem_t read_semaphore;
+	sem_t ring_semaphore;
+} ring_header;
+
+// Paths are appended to blocks which are only freed all at once,
+// so finding millions of files costs a few large allocations.
+typedef struct path_block {
+	struct path_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+} path_block;
+
+// A directory waiting to be walked, opened relative to its parent.
+typedef struct {
+	int fd;
+	const char *path;
+} dir_entry;
+
+// A text file opened by a walker, waiting to be read into the ring.
+typedef struct {
+	int fd;
+	long size;
+	int file_index;
+	const char *path;
+	int is_math;
+} pending_file;
+
+// Opened files on their way from the walkers to the readers (-q).
+// It is bounded, so the walkers never hold more than a few files open.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pending_file *files;
+	int capacity;
+	int count;
+	int head;
+	int tail;
+	int closed; // the walkers are done
+} file_queue;
+
+// The rings shared with the kernel by io_uring, mapped by uringInit.
+typedef struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	int to_submit;
+} uring;
+
+// A file being read by the io_uring reader, with at most one read in flight.
+typedef struct {
+	pending_file file;
+	word_counter state; // counter state at <offset>
+	long offset;
+	int slot; // slot of the read in flight, -1 if none
+	chunk_desc *desc; // record the read goes into
+} uring_read;
+
+// Shared by the walker threads of the parent. Directories found while
+// the queue has room are left to any walker, the rest are walked in place.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	dir_entry dirs[DIR_QUEUE_LIMIT];
+	int dir_count;
+	int busy; // walkers in the middle of a directory
+	int file_count;
+	ring_header *ring;
+	int use_mmap;
+	long slot_size;
+	int min_long_length;
+	int io_depth; // outstanding reads, 0 reads in the walkers
+	file_queue pending;
+	uring io;
+} walk_state;
+
+/**
+ * @brief Counts a chunk which was copied into its record.
+ * 
+ * @param desc : The record holding the chunk.
+ * @return The words in the chunk (long words for math files).
+ */
+long countCopiedChunk(const chunk_desc *desc);
+
+/**
+ * @brief Maps the part of a file described by desc and counts it.
+ * 
+ * @param desc : The part of the file to count.
+ * @return The words in the chunk (long words for math files).
+ */
+long countMappedChunk(const chunk_desc *desc);
+
+/**
+ * @brief Counts the records of the ring until told to stop,
+ * in a worker process.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param worker : The worker number, where its result is kept.
+ * @param use_mmap : Whether the chunks are only descriptors.
+ */
+void countWorker(ring_header *ring, int worker, int use_mmap);
+
+/**
+ * @brief Returns the header of the given slot in the ring.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param slot : The slot index.
+ * @return The slot header, its records follow right after it.
+ */
+slot_header *ringSlot(ring_header *ring, int slot);
+
+/**
+ * @brief Takes a slot out of one of the queues of the ring,
+ * waiting until there is one.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @return The slot index.
+ */
+int ringGet(ring_header *ring, int queue);
+
+/**
+ * @brief Same as ringGet, but returns -1 instead of waiting.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @return The slot index, or -1 if the queue is empty.
+ */
+int ringTryGet(ring_header *ring, int queue);
+
+static int ringTake(ring_header *ring, int queue);
+
+/**
+ * @brief Puts a slot into one of the queues of the ring.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @param slot : The slot index.
+ */
+void ringPut(ring_header *ring, int queue, int slot);
+
+/**
+ * @brief Makes room for a record in the slot being packed, sending the
+ * slot off and starting a new one if it has too little room left.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param packer : The slot being packed by the calling thread.
+ * @param data_size : The chars the record would like to hold.
+ * @param min_size : The fewest chars worth a record in this slot.
+ * @param wait : Whether to wait for a free slot.
+ * @param room : Set to the chars the record can hold, up to data_size.
+ * @return The record header, NULL if there was no free slot to wait for.
+ */
+chunk_desc *packerReserve(ring_header *ring, slot_packer *packer, long data_size, long min_size, int wait, long *room);
+
+/**
+ * @brief Adds the reserved record to its slot.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param packer : The slot being packed by the calling thread.
+ * @param desc : The record from packerReserve.
+ * @param data_size : The chars the record takes in the slot.
+ */
+void packerCommit(ring_header *ring, slot_packer *packer, chunk_desc *desc, long data_size);
+
+/**
+ * @brief Sends the slot being packed to the workers, or gives it back
+ * if it has no records.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param packer : The slot being packed by the calling thread.
+ */
+void packerFlush(ring_header *ring, slot_packer *packer);
+
+/**
+ * @brief Copies "dir/name" into the path arena.
+ * 
+ * @param arena : The first block of the arena, updated when a block is added.
+ * @param dir : The directory path.
+ * @param name : The entry name.
+ * @return The joined path, valid until the arena is freed.
+ */
+const char *pathJoin(path_block **arena, const char *dir, const char *name);
+
+/**
+ * @brief Frees all the blocks of a path arena.
+ * 
+ * @param arena : The first block of the arena.
+ */
+void pathFree(path_block *arena);
+
+/**
+ * @brief Walker thread: walks queued directories until all of them are done.
+ * 
+ * @param args : The walk_state shared by the walkers.
+ * @return The path arena of the walker, to be freed once all walkers are done.
+ */
+void *walkerThread(void *args);
 
 /**
  * @brief This function recursively traverse the source directory.
+ * Text files are sent to the workers as soon as they are found.
+ * 
+ * @param state : The walk state.
+ * @param arena : The path arena of the calling walker.
+ * @param packer : The slot the calling walker packs files into.
+ * @param dir_fd : The directory, opened relative to its parent. It is closed.
+ * @param dir_name : The directory path.
+ */
+void traverseDir(walk_state *state, path_block **arena, slot_packer *packer, int dir_fd, const char *dir_name);
+
+/**
+ * @brief Opens a text file found by a walker and sends it to the workers,
+ * or leaves it to the readers when reading ahead.
+ * 
+ * @param state : The walk state.
+ * @param packer : The slot the calling walker packs files into.
+ * @param dir_fd : The directory holding the file.
+ * @param name : The file name in the directory.
+ * @param path : The full path of the file.
+ */
+void sendFile(walk_state *state, slot_packer *packer, int dir_fd, const char *name, const char *path);
+
+/**
+ * @brief Reads an opened file chunk by chunk into the ring, then closes it.
+ * 
+ * @param state : The walk state.
+ * @param packer : The slot the calling thread packs files into.
+ * @param file : The file to read.
+ */
+void readFile(walk_state *state, slot_packer *packer, pending_file *file);
+
+/**
+ * @brief Puts an opened file into the queue, waiting while it is full.
+ * 
+ * @param queue : The queue of opened files.
+ * @param file : The file to put.
+ */
+void fileQueuePut(file_queue *queue, const pending_file *file);
+
+/**
+ * @brief Takes an opened file out of the queue.
+ * 
+ * @param queue : The queue of opened files.
+ * @param file : Where to store the file.
+ * @param wait : Whether to wait for a file when the queue is empty.
+ * @return 1 if a file was taken, 0 if the queue is empty (and, when
+ * waiting, closed).
+ */
+int fileQueueGet(file_queue *queue, pending_file *file, int wait);
+
+/**
+ * @brief Reader thread of the thread pool backend: reads queued files
+ * one at a time with blocking reads.
+ * 
+ * @param args : The walk_state.
+ */
+void *readerThread(void *args);
+
+/**
+ * @brief Sets up an io_uring with room for <entries> requests.
+ * 
+ * @param io : The io_uring to set up.
+ * @param entries : The number of requests in flight at most.
+ * @return 0 on success, -1 with the reason printed if the kernel does
+ * not support io_uring or its reads (IORING_OP_READ came in Linux 5.6),
+ * or refuses the setup, e.g. too many entries or io_uring disabled.
+ */
+int uringInit(uring *io, unsigned entries);
+
+/**
+ * @brief Unmaps and closes an io_uring.
+ * 
+ * @param io : The io_uring.
+ */
+void uringFree(uring *io);
+
+/**
+ * @brief Reader thread of the io_uring backend: keeps up to io_depth
+ * reads of different files in flight, straight into ring slots.
  * 
- * @param dir_name : The source directory name.
+ * @param args : The walk_state.
  */
-void traverseDir(char *dir_name);
+void *uringReader(void *args);
 
 int main(int argc, char **argv) {
-	int process_id; // Process identifier 
+	shared_region region;
+    ring_header *ring;
+	int use_mmap = 0; // -m: the workers map the files instead of reading them from shared memory
+	int use_huge_pages = 0; // -H: back the ring with huge pages when the system has some
+	int slot_count = DEFAULT_SLOT_COUNT; // -n: number of slots in the ring
+	long slot_size = SHM_SIZE; // -s: size of the data part of a slot in bytes
+	const char *kernel = NULL; // -k: word counting kernel, picked from the CPU by default
+	int min_long_length = DEFAULT_MIN_LONG_LENGTH; // -l: shortest long word in math files
+	int worker_count = 1; // -j: number of worker processes counting words
+	int walker_count = 1; // -w: number of threads walking the directory tree
+	int io_depth = 0; // -q: outstanding reads across files, 0 to read in the walkers
+	const char *io_backend = NULL; // -i: uring or threads, io_uring when supported by default
+	const char *stats_name = NULL; // -S: file to write the stage times to, for wordbench
+	int opt;
 
-	int shmid;
-    char *shared_mem;
-    sem_t *write_semaphore, *read_semaphore;
-    // The source directory. 
-    // It can contain the absolute path or relative path to the directory.
-	char *dir_name = argv[1];
+	while ((opt = getopt(argc, argv, "mHn:s:k:l:j:w:q:i:S:")) != -1) {
+		switch (opt) {
+		case 'm':
+			use_mmap = 1;
+			break;
+		case 'H':
+			use_huge_pages = 1;
+			break;
+		case 'n':
+			slot_count = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			slot_size = strtol(optarg, NULL, 10);
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'l':
+			min_long_length = strtol(optarg, NULL, 10);
+			break;
+		case 'j':
+			worker_count = strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			walker_count = strtol(optarg, NULL, 10);
+			break;
+		case 'q':
+			io_depth = strtol(optarg, NULL, 10);
+			break;
+		case 'i':
+			io_backend = optarg;
+			break;
+		case 'S':
+			stats_name = optarg;
+			break;
+		default:
+			printf("Usage: ./main [-m] [-H] [-j workers] [-w walkers] [-q io_depth] [-i uring|threads] [-n slot_count] [-s slot_size] [-k scalar|sse2|avx2] [-l min_long_length] [-S stats_file] <dir_name>\n"
+				"With -i threads at most %d reads are in flight, whatever -q says.\n", MAX_READER_THREADS);
+			exit(-1);
+		}
+	}
 
-	if (argc < 2) {
-		printf("Main process: Please enter a source directory name.\nUsage: ./main <dir_name>\n");
+	if (optind >= argc) {
+		printf("Main process: Please enter a source directory name.\nUsage: ./main [-m] [-H] [-j workers] [-w walkers] [-q io_depth] [-i uring|threads] [-n slot_count] [-s slot_size] [-k scalar|sse2|avx2] [-l min_long_length] [-S stats_file] <dir_name>\n"
+			"With -i threads at most %d reads are in flight, whatever -q says.\n", MAX_READER_THREADS);
+		exit(-1);
+	}
+	if (slot_count < 1 || slot_size < 1 || min_long_length < 1 || worker_count < 1 || walker_count < 1 || io_depth < 0) {
+		printf("Main process: The slot count, slot size, long word length, worker and walker counts must be positive.\n");
+		exit(-1);
+	}
+	if (io_backend != NULL && strcmp(io_backend, "uring") != 0 && strcmp(io_backend, "threads") != 0) {
+		printf("Main process: The I/O backend must be uring or threads.\n");
+		exit(-1);
+	}
+	if (wordCounterKernel(kernel) == NULL) {
+		printf("Main process: The %s kernel is unknown or not supported on this CPU.\n", kernel);
 		exit(-1);
 	}
 
-	traverseDir(dir_name);
+    // The source directory. 
+    // It can contain the absolute path or relative path to the directory.
+	char *dir_name = argv[optind];
+	int root_fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+	if (root_fd < 0) {
+		perror("opendir failed");
+		exit(EXIT_FAILURE);
+	}
 
     /////////////////////////////////////////////////
     // You can add some code here to prepare before fork.
 
-	// Initialize semaphore for mutual exclusion
-    sem_unlink(VAR_WRITE_SEMAPHORE);
-    sem_unlink(VAR_READ_SEMAPHORE);
-    write_semaphore = sem_open(VAR_WRITE_SEMAPHORE, O_CREAT | O_EXCL, 0644, 1);
-    read_semaphore = sem_open(VAR_READ_SEMAPHORE, O_CREAT | O_EXCL, 0644, 0);
-    if (write_semaphore == SEM_FAILED || read_semaphore == SEM_FAILED) {
-        perror("sem_open failed");
-        exit(EXIT_FAILURE);
-    }
-    // Create shared memory segment
-    shmid = shmget(IPC_PRIVATE, SHM_SIZE, IPC_CREAT | 0666);
-    if (shmid < 0) {
-        perror("shmget failed");
-        exit(EXIT_FAILURE);
-    }
+    // Create shared memory segment, every slot starts on its own cache line
+	long queue_size = (slot_count * sizeof(int) + 63) & ~63L;
+	long results_size = (worker_count * sizeof(long) + 63) & ~63L;
+	// A slot always has room for at least one full chunk, or one path in mmap mode.
+	long slot_data_size = use_mmap && slot_size < PATH_MAX ? PATH_MAX : slot_size;
+	long slot_stride = (RECORD_ALIGN(sizeof(slot_header)) + RECORD_ALIGN(sizeof(chunk_desc)) + slot_data_size + 63) & ~63L;
+	long slots_offset = ((sizeof(ring_header) + 63) & ~63L) + 2 * queue_size + results_size;
+	long shm_size = slots_offset + slot_count * slot_stride;
+	if (sharedRegionCreate(&region, shm_size, use_huge_pages) != 0) {
+		perror("Shared region create failed");
+		exit(EXIT_FAILURE);
+	}
+	if (use_huge_pages && !region.huge) {
+		printf("Main process: No huge pages available, using normal pages.\n");
+	}
+	ring = region.base;
+
+	// Initialize semaphores counting the free and the full slots
+	write_semaphore = &ring->write_semaphore;
+	read_semaphore = &ring->read_semaphore;
+	ring_semaphore = &ring->ring_semaphore;
+	if (sharedSemaphoreInit(write_semaphore, slot_count) != 0 || sharedSemaphoreInit(read_semaphore, 0) != 0
+		|| sharedSemaphoreInit(ring_semaphore, 1) != 0) {
+		perror("Semaphore init failed");
+		exit(EXIT_FAILURE);
+	}
+	ring->slot_count = slot_count;
+	ring->slot_size = slot_size;
+	ring->slot_stride = slot_stride;
+	ring->slots_offset = slots_offset;
+	ring->worker_count = worker_count;
+	ring->results_offset = slots_offset - results_size;
+	ring->queues[FULL_QUEUE] = (slot_queue){0, 0, (sizeof(ring_header) + 63) & ~63L};
+	ring->queues[FREE_QUEUE] = (slot_queue){0, 0, ring->queues[FULL_QUEUE].offset + queue_size};
+	// All slots start out free
+	int *free_slots = (int *)((char *)ring + ring->queues[FREE_QUEUE].offset);
+	for (int i = 0; i < slot_count; ++i) {
+		free_slots[i] = i;
+	}
     /////////////////////////////////////////////////
 
+	printf("Parent process: My ID is %jd\n", (intmax_t) getpid());
 
-	switch (process_id = fork()) {
+	for (int w = 0; w < worker_count; ++w) {
+		switch (fork()) {
+		case 0:
+			/*
+				Child Process
+			*/
+			printf("Child process %d: My ID is %jd\n", w, (intmax_t) getpid());
+			printf("Child process %d: Counting words with the %s kernel\n", w, wordCounterKernel(kernel));
+			countWorker(ring, w, use_mmap);
 
-	default:
-		/*
-			Parent Process
-		*/
-		printf("Parent process: My ID is %jd\n", (intmax_t) getpid());
-        
-        /////////////////////////////////////////////////
-        // Implement your code for parent process here.
-		shared_mem = (char *)shmat(shmid, NULL, 0);
-		if (shared_mem == (char *) -1) {
-			perror("shmat failed");
-			exit(EXIT_FAILURE);
+			// Unmap shared memory
+			sharedRegionDestroy(&region);
+			printf("Child process %d: Finished.\n", w);
+			exit(0);
+
+		case -1:
+			/*
+			Error occurred.
+			*/
+			printf("Fork failed!\n");
+			exit(-1);
 		}
+	}
 
-		
-		for (int i = 0; i < file_count; ++i) {
-			sem_wait(write_semaphore); // wait for child to read content
+	/*
+		Parent Process
+	*/
+    /////////////////////////////////////////////////
+    // Implement your code for parent process here.
+	// The walkers send the text files to the workers while they find them.
+	// The stages overlap, so each one's time is when it ended, from the start.
+	long start_ns = traceClock();
+	walk_state state = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.changed = PTHREAD_COND_INITIALIZER,
+		.dirs = {{root_fd, dir_name}},
+		.dir_count = 1,
+		.ring = ring,
+		.use_mmap = use_mmap,
+		.slot_size = slot_size,
+		.min_long_length = min_long_length,
+		.io_depth = use_mmap ? 0 : io_depth, // nothing to read ahead when the workers map the files
+		.pending = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.changed = PTHREAD_COND_INITIALIZER,
+		},
+	};
 
-			FILE *file = fopen(file_paths[i], "r");
-			printf("Parent process: Reading file %s\n", file_paths[i]);
-			if (!file) {
-				perror("File open failed");
-				continue;
+	// With read ahead the walkers only open the files, the readers fill the ring.
+	int reader_count = 0;
+	pthread_t *readers = NULL;
+	if (state.io_depth > 0) {
+		state.pending.capacity = state.io_depth * FILE_QUEUE_FACTOR;
+		state.pending.files = malloc(state.pending.capacity * sizeof(pending_file));
+		readers = malloc(state.io_depth * sizeof(pthread_t));
+		int use_uring = io_backend == NULL || strcmp(io_backend, "uring") == 0;
+		if (use_uring && uringInit(&state.io, state.io_depth) == 0) {
+			printf("Parent process: Reading ahead with io_uring, %d reads in flight\n", state.io_depth);
+			pthread_create(&readers[reader_count++], NULL, uringReader, &state);
+		} else {
+			if (use_uring) {
+				printf("Parent process: Falling back to reader threads\n");
 			}
-			
-			int read_size;
-			int end_of_file = 0;
-
-			while ((read_size = fread(shared_mem, 1, SHM_SIZE, file)) > 0) {
-				if (read_size < SHM_SIZE) {
-					end_of_file = 1; // mark end of file
-				}
-				
-				// Clear the rest of the buffer
-				memset(shared_mem + read_size, 0, SHM_SIZE - read_size);
-
-				printf("Parent process: Written part of file %s to shared memory.\n", file_paths[i]);
-
-				sem_post(read_semaphore); 
-				sem_wait(write_semaphore); 
+			// Each thread has one read in flight, the rest of the read ahead waits in the file queue
+			int thread_count = state.io_depth < MAX_READER_THREADS ? state.io_depth : MAX_READER_THREADS;
+			printf("Parent process: Reading ahead with %d reader threads\n", thread_count);
+			state.io.fd = -1;
+			while (reader_count < thread_count) {
+				pthread_create(&readers[reader_count++], NULL, readerThread, &state);
 			}
+		}
+	}
 
-			// Check if the file has been read completely
-			if (end_of_file) {
-				strcpy(shared_mem, "EOF");
-				sem_post(read_semaphore); // notify child that file has been read
-			}
+	pthread_t *walkers = malloc(walker_count * sizeof(pthread_t));
+	void **arenas = malloc(walker_count * sizeof(void *));
+	for (int t = 0; t < walker_count; ++t) {
+		pthread_create(&walkers[t], NULL, walkerThread, &state);
+	}
+	for (int t = 0; t < walker_count; ++t) {
+		pthread_join(walkers[t], &arenas[t]);
+	}
+	long walk_ns = traceClock();
 
-			fclose(file);
+	if (state.io_depth > 0) {
+		// No more files will come, the readers stop once the queue is empty.
+		pthread_mutex_lock(&state.pending.lock);
+		state.pending.closed = 1;
+		pthread_cond_broadcast(&state.pending.changed);
+		pthread_mutex_unlock(&state.pending.lock);
+		for (int t = 0; t < reader_count; ++t) {
+			pthread_join(readers[t], NULL);
+		}
+		if (state.io.fd >= 0) {
+			uringFree(&state.io);
 		}
+		free(state.pending.files);
+		free(readers);
+	}
+	long read_ns = traceClock(); // every file is in the ring
+	pthread_mutex_destroy(&state.pending.lock);
+	pthread_cond_destroy(&state.pending.changed);
 
-		
+	// A walker may have walked directories whose paths are in another one's arena
+	for (int t = 0; t < walker_count; ++t) {
+		pathFree(arenas[t]);
+	}
+	free(arenas);
+	free(walkers);
+	pthread_mutex_destroy(&state.lock);
+	pthread_cond_destroy(&state.changed);
 
-		// Ensure the child process has finished reading the last file
-		sem_wait(write_semaphore); 
+	// One stop slot per worker, each worker takes exactly one.
+	for (int w = 0; w < worker_count; ++w) {
+		int slot = ringGet(ring, FREE_QUEUE);
+		ringSlot(ring, slot)->record_count = 0;
+		ringSlot(ring, slot)->stop = 1;
+		ringPut(ring, FULL_QUEUE, slot);
+	}
 
-		wait(NULL); // wait for child process to finish
+	for (int w = 0; w < worker_count; ++w) {
+		wait(NULL); // wait for the workers to finish
+	}
+	long count_ns = traceClock();
 
-		// Detach and delete shared memory
-		shmdt(shared_mem);
-		shmctl(shmid, IPC_RMID, NULL);
+	// Add up the counts of the workers
+	long *results = (long *)((char *)ring + ring->results_offset);
+	long total_word_count = 0;
+	for (int w = 0; w < worker_count; ++w) {
+		total_word_count += results[w];
+	}
 
-		sem_close(write_semaphore);
-		sem_close(read_semaphore);
-		sem_unlink(VAR_WRITE_SEMAPHORE);
-		sem_unlink(VAR_READ_SEMAPHORE);
-        /////////////////////////////////////////////////
+	// Write total word count to result file, as a string since it may not fit an int
+	char total_text[32];
+	snprintf(total_text, sizeof(total_text), "%ld", total_word_count);
+	saveResultString("p2_result.txt", total_text);
 
+	if (stats_name != NULL) {
+		FILE *stats = fopen(stats_name, "w");
+		if (stats == NULL) {
+			perror("Stats open failed");
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stats, "walk %.6f\nread %.6f\ncount %.6f\n",
+			(walk_ns - start_ns) / 1e9, (read_ns - start_ns) / 1e9, (count_ns - start_ns) / 1e9);
+		fclose(stats);
+	}
 
-		printf("Parent process: Finished.\n");
-		break;
+	// The workers are gone, destroy the semaphores and unmap the shared memory
+	sem_destroy(write_semaphore);
+	sem_destroy(read_semaphore);
+	sem_destroy(ring_semaphore);
+	sharedRegionDestroy(&region);
+    /////////////////////////////////////////////////
 
-	case 0:
-		/*
-			Child Process
-		*/
+	printf("Parent process: Finished.\n");
+	exit(0);
+}
 
-		printf("Child process: My ID is %jd\n", (intmax_t) getpid());
+/**
+ * @brief Counts the records of the ring until told to stop,
+ * in a worker process.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param worker : The worker number, where its result is kept.
+ * @param use_mmap : Whether the chunks are only descriptors.
+ */
+void countWorker(ring_header *ring, int worker, int use_mmap) {
+	long total_word_count = 0;
 
-        /////////////////////////////////////////////////
-        // Implement your code for child process here.
-		shared_mem = (char *)shmat(shmid, NULL, 0);
-		if (shared_mem == (char *) -1) {
-			perror("shmat failed");
-			exit(EXIT_FAILURE);
+	while (1) {
+		int slot = ringGet(ring, FULL_QUEUE); // wait for parent to fill a slot
+		slot_header *header = ringSlot(ring, slot);
+		if (header->stop) {
+			ringPut(ring, FREE_QUEUE, slot);
+			break;
 		}
 
-		int total_word_count = 0;
-		
-		for (int i = 0; i < file_count; ++i) {
-			while (1) {
-				sem_wait(read_semaphore); // wait for parent to write content
-
-				if (strcmp(shared_mem, "EOF") == 0) {
-					sem_post(write_semaphore); // notify parent that file has been read
-					break;
-				}
-
-				// check if file is math.txt
-				if (strstr(file_paths[i], "math")) {
-					//define a pipe to pass long word count to parent
-					int pipe_fd[2];
-					if (pipe(pipe_fd) == -1) {
-						perror("pipe failed");
-						exit(EXIT_FAILURE);
-					}
-					if (fork() == 0) { // in child process
-						
-						close(pipe_fd[0]); 
-						int long_word_count = countLongWords(shared_mem);
-						write(pipe_fd[1], &long_word_count, sizeof(int)); 
-						close(pipe_fd[1]);
-						exit(0); 
-					} else {
-						int long_word_count;
-						read(pipe_fd[0], &long_word_count, sizeof(int));
-						total_word_count += long_word_count;
-					}
-				}else{
-					int word_count = wordCount(shared_mem); // 统计当前块的单词数
-					total_word_count += word_count;
-					printf("Child process: Counted %d words in file %s\n", word_count, file_paths[i]);
-				}
-				sem_post(write_semaphore); // 通知父进程可继续写入共享内存
-			}
+		long word_count = 0;
+		int record_count = header->record_count;
+		long offset = RECORD_ALIGN(sizeof(slot_header));
+		for (int r = 0; r < record_count; ++r) {
+			chunk_desc *desc = (chunk_desc *)((char *)header + offset);
+			word_count += use_mmap ? countMappedChunk(desc) : countCopiedChunk(desc);
+			offset = desc->next;
 		}
+		total_word_count += word_count;
 
-		// Write total word count to result file
-		saveResult("p2_result.txt", total_word_count);
+		ringPut(ring, FREE_QUEUE, slot); // 通知父进程可继续写入共享内存
+		printf("Child process %d: Counted %ld words in %d parts of files\n", worker, word_count, record_count);
+	}
 
-		// Detach shared memory
-		shmdt(shared_mem);
-        /////////////////////////////////////////////////
+	long *results = (long *)((char *)ring + ring->results_offset);
+	results[worker] = total_word_count;
+}
 
+/**
+ * @brief Counts a chunk which was copied into its record.
+ * 
+ * @param desc : The record holding the chunk.
+ * @return The words in the chunk (long words for math files).
+ */
+long countCopiedChunk(const chunk_desc *desc) {
+	// A word running into the next chunk is finished (and counted if long) there.
+	word_counter counter = desc->entry;
+	wordCounterFeed(&counter, (const char *)(desc + 1), desc->length);
+	if (desc->end_of_file) {
+		wordCounterFinish(&counter);
+	}
+	return counter.min_long_length > 0 ? counter.long_words : counter.words;
+}
 
-		printf("Child process: Finished.\n");
-		exit(0);
+/**
+ * @brief Maps the part of a file described by desc and counts it.
+ * 
+ * @param desc : The part of the file to count.
+ * @return The words in the chunk (long words for math files).
+ */
+long countMappedChunk(const chunk_desc *desc) {
+	word_counter counter = desc->entry;
+	if (desc->length <= 0) {
+		wordCounterFinish(&counter);
+		return counter.min_long_length > 0 ? counter.long_words : counter.words;
+	}
 
-	case -1:
-		/*
-		Error occurred.
-		*/
-		printf("Fork failed!\n");
-		exit(-1);
+	int fd = open((const char *)(desc + 1), O_RDONLY);
+	if (fd < 0) {
+		perror("File open failed");
+		return 0;
 	}
 
-	exit(0);
+	// Also map a few chars before the chunk to find out if it starts inside
+	// a word and how long that word is so far, up to the long word length.
+	long before = counter.min_long_length > 1 ? counter.min_long_length : 1;
+	if (before > desc->offset) {
+		before = desc->offset;
+	}
+	// mmap needs a page aligned offset, so map a bit earlier and skip the head.
+	long page_size = sysconf(_SC_PAGESIZE);
+	long start = desc->offset - before;
+	long head = start % page_size;
+	size_t map_length = desc->length + before + head;
+	char *map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, start - head);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap failed");
+		return 0;
+	}
+	madvise(map, map_length, MADV_SEQUENTIAL);
+
+	wordCounterSkip(&counter, map + head, before);
+	wordCounterFeed(&counter, map + head + before, desc->length);
+	if (desc->end_of_file) {
+		wordCounterFinish(&counter);
+	}
+
+	munmap(map, map_length);
+	return counter.min_long_length > 0 ? counter.long_words : counter.words;
 }
+
 /**
- * calculate the number of words in math.txt file
+ * @brief Returns the header of the given slot in the ring.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param slot : The slot index.
+ * @return The slot header, its records follow right after it.
  */
-int countLongWords(char *text) {
-    int count = 0;
-    char buffer[SHM_SIZE];  // 创建本地缓冲区
-    strncpy(buffer, text, SHM_SIZE);  // 复制共享内存内容到本地缓冲区
-    buffer[SHM_SIZE - 1] = '\0';  // 确保字符串以 null 结尾
+slot_header *ringSlot(ring_header *ring, int slot) {
+	return (slot_header *)((char *)ring + ring->slots_offset + slot * ring->slot_stride);
+}
 
-    char *token = strtok(buffer, " \n");  // 在本地缓冲区上操作
-    while (token != NULL) {
-        if (strlen(token) > 5) {
-            count++;
-        }
-        token = strtok(NULL, " \n");
-    }
-    return count;
+/**
+ * @brief Takes a slot out of one of the queues of the ring,
+ * waiting until there is one.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @return The slot index.
+ */
+int ringGet(ring_header *ring, int queue) {
+	sem_wait(queue == FULL_QUEUE ? read_semaphore : write_semaphore);
+	return ringTake(ring, queue);
+}
+
+/**
+ * @brief Same as ringGet, but returns -1 instead of waiting.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @return The slot index, or -1 if the queue is empty.
+ */
+int ringTryGet(ring_header *ring, int queue) {
+	if (sem_trywait(queue == FULL_QUEUE ? read_semaphore : write_semaphore) != 0) {
+		return -1;
+	}
+	return ringTake(ring, queue);
+}
+
+/**
+ * @brief Takes the next slot out of a queue once the caller holds
+ * one of its counts.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @return The slot index.
+ */
+static int ringTake(ring_header *ring, int queue) {
+
+	sem_wait(ring_semaphore);
+	slot_queue *q = &ring->queues[queue];
+	int *entries = (int *)((char *)ring + q->offset);
+	int slot = entries[q->tail];
+	q->tail = (q->tail + 1) % ring->slot_count;
+	sem_post(ring_semaphore);
+
+	return slot;
+}
+
+/**
+ * @brief Puts a slot into one of the queues of the ring.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param queue : FULL_QUEUE or FREE_QUEUE.
+ * @param slot : The slot index.
+ */
+void ringPut(ring_header *ring, int queue, int slot) {
+	sem_wait(ring_semaphore);
+	slot_queue *q = &ring->queues[queue];
+	int *entries = (int *)((char *)ring + q->offset);
+	entries[q->head] = slot;
+	q->head = (q->head + 1) % ring->slot_count;
+	sem_post(ring_semaphore);
+
+	sem_post(queue == FULL_QUEUE ? read_semaphore : write_semaphore);
+}
+
+/**
+ * @brief Makes room for a record in the slot being packed, sending the
+ * slot off and starting a new one if it has too little room left.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param packer : The slot being packed by the calling thread.
+ * @param data_size : The chars the record would like to hold.
+ * @param min_size : The fewest chars worth a record in this slot.
+ * @param wait : Whether to wait for a free slot.
+ * @param room : Set to the chars the record can hold, up to data_size.
+ * @return The record header, NULL if there was no free slot to wait for.
+ */
+chunk_desc *packerReserve(ring_header *ring, slot_packer *packer, long data_size, long min_size, int wait, long *room) {
+	long record_size = RECORD_ALIGN(sizeof(chunk_desc));
+
+	if (packer->slot >= 0 && ring->slot_stride - packer->used - record_size < min_size) {
+		packerFlush(ring, packer);
+	}
+	if (packer->slot < 0) {
+		packer->slot = wait ? ringGet(ring, FREE_QUEUE) : ringTryGet(ring, FREE_QUEUE);
+		if (packer->slot < 0) {
+			return NULL;
+		}
+		slot_header *header = ringSlot(ring, packer->slot);
+		header->record_count = 0;
+		header->stop = 0;
+		packer->used = RECORD_ALIGN(sizeof(slot_header));
+	}
+
+	long free_size = ring->slot_stride - packer->used - record_size;
+	*room = data_size < free_size ? data_size : free_size;
+	return (chunk_desc *)((char *)ringSlot(ring, packer->slot) + packer->used);
+}
+
+/**
+ * @brief Adds the reserved record to its slot.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param packer : The slot being packed by the calling thread.
+ * @param desc : The record from packerReserve.
+ * @param data_size : The chars the record takes in the slot.
+ */
+void packerCommit(ring_header *ring, slot_packer *packer, chunk_desc *desc, long data_size) {
+	packer->used += RECORD_ALIGN(sizeof(chunk_desc)) + RECORD_ALIGN(data_size);
+	desc->next = packer->used;
+	ringSlot(ring, packer->slot)->record_count++;
+}
+
+/**
+ * @brief Sends the slot being packed to the workers, or gives it back
+ * if it has no records.
+ * 
+ * @param ring : The ring at the start of the shared memory.
+ * @param packer : The slot being packed by the calling thread.
+ */
+void packerFlush(ring_header *ring, slot_packer *packer) {
+	int slot = packer->slot;
+	if (slot < 0) {
+		return;
+	}
+	packer->slot = -1;
+
+	if (ringSlot(ring, slot)->record_count == 0) {
+		ringPut(ring, FREE_QUEUE, slot);
+	} else if (packer->pending != NULL && packer->pending[slot] > 0) {
+		packer->sealed[slot] = 1; // sent by the last of its reads
+	} else {
+		ringPut(ring, FULL_QUEUE, slot); // notify the workers that a slot is full
+	}
+}
+
+/**
+ * @brief Copies "dir/name" into the path arena.
+ * 
+ * @param arena : The first block of the arena, updated when a block is added.
+ * @param dir : The directory path.
+ * @param name : The entry name.
+ * @return The joined path, valid until the arena is freed.
+ */
+const char *pathJoin(path_block **arena, const char *dir, const char *name) {
+	size_t dir_length = strlen(dir);
+	size_t name_length = strlen(name);
+	size_t length = dir_length + 1 + name_length + 1;
+
+	path_block *block = *arena;
+	if (block == NULL || block->size - block->used < length) {
+		size_t size = length > PATH_BLOCK_SIZE ? length : PATH_BLOCK_SIZE;
+		block = malloc(sizeof(path_block) + size);
+		if (block == NULL) {
+			perror("malloc failed");
+			exit(EXIT_FAILURE);
+		}
+		block->next = *arena;
+		block->used = 0;
+		block->size = size;
+		*arena = block;
+	}
+
+	char *path = block->data + block->used;
+	memcpy(path, dir, dir_length);
+	path[dir_length] = '/';
+	memcpy(path + dir_length + 1, name, name_length + 1);
+	block->used += length;
+	return path;
+}
+
+/**
+ * @brief Frees all the blocks of a path arena.
+ * 
+ * @param arena : The first block of the arena.
+ */
+void pathFree(path_block *arena) {
+	while (arena != NULL) {
+		path_block *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+/**
+ * @brief Walker thread: walks queued directories until all of them are done.
+ * 
+ * @param args : The walk_state shared by the walkers.
+ * @return The path arena of the walker, to be freed once all walkers are done.
+ */
+void *walkerThread(void *args) {
+	walk_state *state = (walk_state *)args;
+	path_block *arena = NULL;
+	slot_packer packer = {-1, 0, NULL, NULL};
+
+	pthread_mutex_lock(&state->lock);
+	while (1) {
+		// The walk is over when nothing is queued and nobody can queue more.
+		if (state->dir_count == 0 && state->busy > 0) {
+			// Do not sit on packed files while waiting
+			pthread_mutex_unlock(&state->lock);
+			packerFlush(state->ring, &packer);
+			pthread_mutex_lock(&state->lock);
+		}
+		while (state->dir_count == 0 && state->busy > 0) {
+			pthread_cond_wait(&state->changed, &state->lock);
+		}
+		if (state->dir_count == 0) {
+			break;
+		}
+		dir_entry dir = state->dirs[--state->dir_count];
+		state->busy++;
+		pthread_mutex_unlock(&state->lock);
+
+		traverseDir(state, &arena, &packer, dir.fd, dir.path);
+
+		pthread_mutex_lock(&state->lock);
+		state->busy--;
+		if (state->busy == 0 && state->dir_count == 0) {
+			pthread_cond_broadcast(&state->changed);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+	packerFlush(state->ring, &packer);
+
+	return arena;
 }
 
 /**
  * @brief This function recursively traverse the source directory.
+ * Text files are sent to the workers as soon as they are found.
  * 
- * @param dir_name : The source directory name.
+ * @param state : The walk state.
+ * @param arena : The path arena of the calling walker.
+ * @param packer : The slot the calling walker packs files into.
+ * @param dir_fd : The directory, opened relative to its parent. It is closed.
+ * @param dir_name : The directory path.
  */
-void traverseDir(char *dir_name){
+void traverseDir(walk_state *state, path_block **arena, slot_packer *packer, int dir_fd, const char *dir_name){
    
     // Implement your code here to find out
     // all textfiles in the source directory.
-	DIR *dir = opendir(dir_name);
+	DIR *dir = fdopendir(dir_fd);
     struct dirent *entry;
 
     if (!dir) {
         perror("opendir failed");
-        exit(EXIT_FAILURE);
+        close(dir_fd);
+        return;
     }
 
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR) {
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            // Some file systems do not fill in d_type
+            struct stat st;
+            if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
             // Skip current and parent directories
             if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
                 continue;
             }
 
-            // Construct new path
-            char path[1024];
-            snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
-            traverseDir(path);
-        } else if (entry->d_type == DT_REG) {
+            int sub_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY);
+            if (sub_fd < 0) {
+                perror("opendir failed");
+                continue;
+            }
+            const char *path = pathJoin(arena, dir_name, entry->d_name);
+
+            // Leave the directory to any walker if the queue has room, else walk it here.
+            pthread_mutex_lock(&state->lock);
+            int queued = state->dir_count < DIR_QUEUE_LIMIT;
+            if (queued) {
+                state->dirs[state->dir_count++] = (dir_entry){sub_fd, path};
+                pthread_cond_signal(&state->changed);
+            }
+            pthread_mutex_unlock(&state->lock);
+            if (!queued) {
+                traverseDir(state, arena, packer, sub_fd, path);
+            }
+        } else if (type == DT_REG) {
             // Check if the file has .txt extension
             if (strstr(entry->d_name, ".txt")) {
-                if (file_count < MAX_FILES) {
-                    char *path = malloc(1024);
-                    snprintf(path, 1024, "%s/%s", dir_name, entry->d_name);
-                    file_paths[file_count++] = path;
-                    printf("Found text file: %s\n", path);
-                } else {
-                    printf("Reached maximum file count (%d). Skipping extra files.\n", MAX_FILES);
-                    break;
-                }
+                sendFile(state, packer, dir_fd, entry->d_name, pathJoin(arena, dir_name, entry->d_name));
             }
         }
     }
     closedir(dir);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Opens a text file found by a walker and sends it to the workers,
+ * or leaves it to the readers when reading ahead.
+ * 
+ * @param state : The walk state.
+ * @param packer : The slot the calling walker packs files into.
+ * @param dir_fd : The directory holding the file.
+ * @param name : The file name in the directory.
+ * @param path : The full path of the file.
+ */
+void sendFile(walk_state *state, slot_packer *packer, int dir_fd, const char *name, const char *path) {
+	ring_header *ring = state->ring;
+	struct stat st;
+
+	pthread_mutex_lock(&state->lock);
+	int file_index = state->file_count++;
+	pthread_mutex_unlock(&state->lock);
+	printf("Found text file %d: %s\n", file_index, path);
+
+	pending_file file = {-1, 0, file_index, path, strstr(path, "math") != NULL};
+
+	if (!state->use_mmap) {
+		file.fd = openat(dir_fd, name, O_RDONLY);
+		if (file.fd < 0 || fstat(file.fd, &st) != 0) {
+			perror("File open failed");
+			if (file.fd >= 0) {
+				close(file.fd);
+			}
+			return;
+		}
+		file.size = st.st_size;
+
+		if (state->io_depth > 0) {
+			// Let the kernel start reading while the file waits for a reader.
+			posix_fadvise(file.fd, 0, 0, POSIX_FADV_WILLNEED);
+			fileQueuePut(&state->pending, &file);
+		} else {
+			readFile(state, packer, &file);
+		}
+		return;
+	}
+
+	// Only hand over where the file is, the workers map it by themselves.
+	if (fstatat(dir_fd, name, &st, 0) != 0) {
+		perror("File stat failed");
+		return;
+	}
+	word_counter entry;
+	wordCounterInit(&entry, file.is_math ? state->min_long_length : 0);
+	long path_size = strlen(path) + 1;
+	long offset = 0;
+	do {
+		long room;
+		chunk_desc *desc = packerReserve(ring, packer, path_size, path_size, 1, &room);
+		desc->file_index = file_index;
+		desc->offset = offset;
+		desc->entry = entry;
+		desc->length = st.st_size - offset < state->slot_size ? st.st_size - offset : state->slot_size;
+		offset += desc->length;
+		desc->end_of_file = offset >= st.st_size;
+		memcpy(desc + 1, path, path_size);
+		packerCommit(ring, packer, desc, path_size);
+	} while (offset < st.st_size);
+}
+
+/**
+ * @brief Reads an opened file chunk by chunk into the ring, then closes it.
+ * 
+ * @param state : The walk state.
+ * @param packer : The slot the calling thread packs files into.
+ * @param file : The file to read.
+ */
+void readFile(walk_state *state, slot_packer *packer, pending_file *file) {
+	ring_header *ring = state->ring;
+
+	// The state of the file's word counter at the start of the next chunk,
+	// so every chunk can be counted by any worker on its own.
+	word_counter counter_state;
+	wordCounterInit(&counter_state, file->is_math ? state->min_long_length : 0);
+
+	long offset = 0;
+	long remaining = file->size;
+	int end_of_file = remaining <= 0;
+	while (!end_of_file) {
+		// Small files and file tails share a slot with what came before them.
+		long want;
+		chunk_desc *desc = packerReserve(ring, packer, remaining, remaining < MIN_RECORD_DATA ? remaining : MIN_RECORD_DATA, 1, &want);
+		char *data = (char *)(desc + 1);
+		ssize_t read_size = read(file->fd, data, want);
+		desc->file_index = file->file_index;
+		desc->offset = offset;
+		desc->entry = counter_state;
+		desc->length = read_size > 0 ? read_size : 0;
+		wordCounterSkip(&counter_state, data, desc->length);
+		offset += desc->length;
+		remaining -= desc->length;
+		end_of_file = (remaining <= 0 || desc->length == 0);
+		desc->end_of_file = end_of_file;
+		packerCommit(ring, packer, desc, desc->length);
+
+		printf("Parent process: Written part of file %s to shared memory.\n", file->path);
+	}
+
+	close(file->fd);
+}
+
+/**
+ * @brief Puts an opened file into the queue, waiting while it is full.
+ * 
+ * @param queue : The queue of opened files.
+ * @param file : The file to put.
+ */
+void fileQueuePut(file_queue *queue, const pending_file *file) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity) {
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	}
+	queue->files[queue->head] = *file;
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count++;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Takes an opened file out of the queue.
+ * 
+ * @param queue : The queue of opened files.
+ * @param file : Where to store the file.
+ * @param wait : Whether to wait for a file when the queue is empty.
+ * @return 1 if a file was taken, 0 if the queue is empty (and, when
+ * waiting, closed).
+ */
+int fileQueueGet(file_queue *queue, pending_file *file, int wait) {
+	pthread_mutex_lock(&queue->lock);
+	while (wait && queue->count == 0 && !queue->closed) {
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	}
+	int taken = queue->count > 0;
+	if (taken) {
+		*file = queue->files[queue->tail];
+		queue->tail = (queue->tail + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_broadcast(&queue->changed);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return taken;
+}
+
+/**
+ * @brief Reader thread of the thread pool backend: reads queued files
+ * one at a time with blocking reads.
+ * 
+ * @param args : The walk_state.
+ */
+void *readerThread(void *args) {
+	walk_state *state = (walk_state *)args;
+	slot_packer packer = {-1, 0, NULL, NULL};
+	pending_file file;
+
+	while (1) {
+		if (!fileQueueGet(&state->pending, &file, 0)) {
+			// Do not sit on packed files while waiting for more
+			packerFlush(state->ring, &packer);
+			if (!fileQueueGet(&state->pending, &file, 1)) {
+				break;
+			}
+		}
+		readFile(state, &packer, &file);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Sets up an io_uring with room for <entries> requests.
+ * 
+ * @param io : The io_uring to set up.
+ * @param entries : The number of requests in flight at most.
+ * @return 0 on success, -1 with the reason printed if the kernel does
+ * not support io_uring or its reads (IORING_OP_READ came in Linux 5.6),
+ * or refuses the setup, e.g. too many entries or io_uring disabled.
+ */
+int uringInit(uring *io, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	io->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (io->fd < 0) {
+		printf("Parent process: io_uring setup failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// Kernels with io_uring but without IORING_OP_READ fail every read with
+	// EINVAL. The probe itself also came in 5.6, so a failed probe means no reads.
+	struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op));
+	int can_read = syscall(__NR_io_uring_register, io->fd, IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == 0
+		&& IORING_OP_READ <= probe->last_op && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!can_read) {
+		printf("Parent process: io_uring reads (IORING_OP_READ) are not supported by this kernel\n");
+		close(io->fd);
+		io->fd = -1;
+		return -1;
+	}
+
+	io->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	io->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		// Both rings share one mapping
+		if (io->cq_size > io->sq_size) {
+			io->sq_size = io->cq_size;
+		}
+		io->cq_size = io->sq_size;
+	}
+	io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	io->sq_ptr = mmap(NULL, io->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->fd, IORING_OFF_SQ_RING);
+	io->cq_ptr = io->sq_ptr;
+	if (io->sq_ptr != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		io->cq_ptr = mmap(NULL, io->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->fd, IORING_OFF_CQ_RING);
+	}
+	io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->fd, IORING_OFF_SQES);
+	if (io->sq_ptr == MAP_FAILED || io->cq_ptr == MAP_FAILED || io->sqes == MAP_FAILED) {
+		perror("io_uring mmap failed");
+		close(io->fd);
+		io->fd = -1;
+		return -1;
+	}
+
+	char *sq = (char *)io->sq_ptr;
+	char *cq = (char *)io->cq_ptr;
+	io->sq_head = (unsigned *)(sq + params.sq_off.head);
+	io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	io->sq_array = (unsigned *)(sq + params.sq_off.array);
+	io->cq_head = (unsigned *)(cq + params.cq_off.head);
+	io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	io->to_submit = 0;
+	return 0;
+}
+
+/**
+ * @brief Unmaps and closes an io_uring.
+ * 
+ * @param io : The io_uring.
+ */
+void uringFree(uring *io) {
+	munmap(io->sqes, io->sqes_size);
+	if (io->cq_ptr != io->sq_ptr) {
+		munmap(io->cq_ptr, io->cq_size);
+	}
+	munmap(io->sq_ptr, io->sq_size);
+	close(io->fd);
+	io->fd = -1;
+}
+
+/**
+ * @brief Queues the next read of a file into its record, submitted
+ * with the next io_uring_enter.
+ */
+static void uringQueueRead(walk_state *state, uring_read *request, long length) {
+	uring *io = &state->io;
+
+	unsigned tail = *io->sq_tail;
+	unsigned index = tail & *io->sq_mask;
+	struct io_uring_sqe *sqe = &io->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = request->file.fd;
+	sqe->addr = (unsigned long)(request->desc + 1);
+	sqe->len = length;
+	sqe->off = request->offset;
+	sqe->user_data = (unsigned long)request;
+	io->sq_array[index] = index;
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	io->to_submit++;
+}
+
+/**
+ * @brief Reader thread of the io_uring backend: keeps up to io_depth
+ * reads of different files in flight, straight into ring slots.
+ * 
+ * @param args : The walk_state.
+ */
+void *uringReader(void *args) {
+	walk_state *state = (walk_state *)args;
+	ring_header *ring = state->ring;
+	uring *io = &state->io;
+	uring_read *reads = calloc(state->io_depth, sizeof(uring_read));
+	slot_packer packer = {-1, 0, calloc(ring->slot_count, sizeof(int)), calloc(ring->slot_count, 1)};
+	int open_count = 0; // files being read
+	int in_flight = 0;
+	int no_more_files = 0;
+
+	for (int i = 0; i < state->io_depth; ++i) {
+		reads[i].file.fd = -1;
+		reads[i].slot = -1;
+	}
+
+	while (1) {
+		// Take new files for the idle entries, only waiting if nothing else is going on.
+		for (int i = 0; i < state->io_depth && !no_more_files; ++i) {
+			if (reads[i].file.fd >= 0) {
+				continue;
+			}
+			int got_file = fileQueueGet(&state->pending, &reads[i].file, 0);
+			if (!got_file && open_count == 0) {
+				// Do not sit on packed files while waiting for more
+				packerFlush(ring, &packer);
+				got_file = fileQueueGet(&state->pending, &reads[i].file, 1);
+			}
+			if (!got_file) {
+				no_more_files = open_count == 0;
+				break;
+			}
+			if (reads[i].file.size <= 0) {
+				close(reads[i].file.fd);
+				reads[i].file.fd = -1;
+				continue;
+			}
+			reads[i].offset = 0;
+			wordCounterInit(&reads[i].state, reads[i].file.is_math ? state->min_long_length : 0);
+			open_count++;
+		}
+		if (open_count == 0) {
+			if (no_more_files) {
+				break;
+			}
+			continue;
+		}
+
+		// Give every open file without a read in flight a record to read into.
+		// Slots are only waited for when no read could free the wait.
+		for (int i = 0; i < state->io_depth; ++i) {
+			if (reads[i].file.fd < 0 || reads[i].slot >= 0) {
+				continue;
+			}
+			long remaining = reads[i].file.size - reads[i].offset;
+			long length;
+			reads[i].desc = packerReserve(ring, &packer, remaining, remaining < MIN_RECORD_DATA ? remaining : MIN_RECORD_DATA, in_flight == 0, &length);
+			if (reads[i].desc == NULL) {
+				break;
+			}
+			reads[i].slot = packer.slot;
+			packerCommit(ring, &packer, reads[i].desc, length);
+			packer.pending[reads[i].slot]++;
+			uringQueueRead(state, &reads[i], length);
+			in_flight++;
+		}
+
+		// Submit the new reads and wait for at least one to complete.
+		int submitted = syscall(__NR_io_uring_enter, io->fd, io->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("io_uring_enter failed");
+			exit(EXIT_FAILURE);
+		}
+		io->to_submit -= submitted;
+
+		unsigned head = *io->cq_head;
+		while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+			uring_read *request = (uring_read *)(unsigned long)cqe->user_data;
+			int result = cqe->res;
+			head++;
+			in_flight--;
+
+			chunk_desc *desc = request->desc;
+			desc->file_index = request->file.file_index;
+			desc->offset = request->offset;
+			desc->entry = request->state;
+			desc->length = result > 0 ? result : 0;
+			wordCounterSkip(&request->state, (const char *)(desc + 1), desc->length);
+			request->offset += desc->length;
+			int end_of_file = result <= 0 || request->offset >= request->file.size;
+			desc->end_of_file = end_of_file;
+			if (result < 0) {
+				errno = -result;
+				perror("File read failed");
+			}
+
+			printf("Parent process: Written part of file %s to shared memory.\n", request->file.path);
+
+			// The last read into a full slot sends it off.
+			int slot = request->slot;
+			if (--packer.pending[slot] == 0 && packer.sealed[slot]) {
+				packer.sealed[slot] = 0;
+				ringPut(ring, FULL_QUEUE, slot); // notify the workers that a slot is full
+			}
+			request->slot = -1;
+			if (end_of_file) {
+				close(request->file.fd);
+				request->file.fd = -1;
+				open_count--;
+			}
+		}
+		__atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	packerFlush(ring, &packer);
+	free(packer.pending);
+	free(packer.sealed);
+	free(reads);
+	return NULL;
+}
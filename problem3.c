@@ -4,55 +4,388 @@
 #include <semaphore.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include "utils.h"
 
-#define NUM_CHEFS 3
-#define DISHES_PER_CHEF 10
+#define NUM_OFFERS 3 // ingredient sets the provider offers, chef i cooks set i % NUM_OFFERS
+#define DEFAULT_CHEFS 3
+#define DEFAULT_DISHES_PER_CHEF 10
+#define DEFAULT_COOKING_TIMES "5,3,1"
+
+// Orders handed to a chef, as the numbers of the orders. The chef takes the
+// newest from the bottom, idle chefs of the same ingredient set steal the
+// oldest from the top. A chef is never handed more than dishesPerChef orders,
+// so the entries do not wrap around.
+typedef struct {
+    pthread_mutex_t lock;
+    int *orders;
+    int top; // next order to steal
+    int bottom; // next free entry
+} order_deque;
 
 // Semaphores and mutex declarations
-sem_t semaphoreChefs[NUM_CHEFS];
-sem_t semaphoreFinish;
+sem_t semaphoreOffers[NUM_OFFERS]; // counts the orders of each ingredient set waiting in the deques
+sem_t semaphoreFinish; // counts the orders which may still be handed out, a chef posts it when a dish is done
 sem_t providerReady;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// The kitchen, chosen with -c, -P, -d, -t and -r
+int chefCount = DEFAULT_CHEFS;
+int providerCount = 1;
+int dishesPerChef = DEFAULT_DISHES_PER_CHEF;
+int *cookingTimes; // per chef, the -t list repeated over the chefs
+int providerPrepTime = 2;
+
 // Shared variables
-int chefCookCount[NUM_CHEFS];
+order_deque *chefOrders;
+int *chefCookCount;
+int *chefOrdered; // orders handed out per chef, only changed by the providers under the mutex
+int *chefQueued; // orders each chef has still to cook, counting the one cooking and the ones being prepared, under the mutex
+double *chefDoneTime; // seconds from the start to the last dish of each chef
+int *providerOrderCount; // orders prepared by each provider
+int ordersGiven = 0; // orders the providers have taken on, under the mutex
+int lastPicked; // chef of the last order taken on, under the mutex
+int ordersClosed = 0; // set once the providers are done, no order is pushed after it
 int allCooked = 0;
-double totalCookingTime = 0.0;
+double totalCookingTime = 0.0; // seconds the chefs spent cooking, summed over the chefs
 
-const char* providerOffers[NUM_CHEFS] = {"Vegetables & Meat (A+B)", "Meat & Spices (B+C)", "Vegetables & Spices (A+C)"};
-const int cookingTimes[NUM_CHEFS] = {5, 3, 1};
-const int providerPrepTime = 2;
+const char* providerOffers[NUM_OFFERS] = {"Vegetables & Meat (A+B)", "Meat & Spices (B+C)", "Vegetables & Spices (A+C)"};
 
 struct timespec startTime, endTime;
 
+// Orders the providers may have handed out and not yet seen cooked, chosen with -p.
+// With 1 the provider waits for every dish before preparing the next order.
+int ordersInFlight = 1;
+
+// Milliseconds of one time unit of the prep and cooking times, chosen with -u
+int timeUnitMs = 1000;
+
+// How the providers pick the chef of the next order, chosen with -s
+typedef enum {
+    POLICY_RR,   // round-robin
+    POLICY_SJF,  // the chef with the shortest cooking time first
+    POLICY_LPT,  // the chef with the longest cooking time first
+    POLICY_IDLE, // the chef which will be done with its orders soonest first
+    POLICY_COUNT
+} schedule_policy;
+const char *policyNames[POLICY_COUNT] = {"rr", "sjf", "lpt", "idle"};
+schedule_policy policy = POLICY_RR;
+
+// Whether the kitchen runs as threads sleeping for real, or as a discrete-event
+// simulation on a virtual clock, chosen with -m
+typedef enum {
+    MODE_THREADS,
+    MODE_SIM,
+    MODE_COUNT
+} run_mode;
+const char *modeNames[MODE_COUNT] = {"threads", "sim"};
+run_mode mode = MODE_THREADS;
+
+// What happens at an instant of the simulation
+typedef enum {
+    EVENT_PREP_DONE, // a provider has the ingredients of an order ready
+    EVENT_COOK_DONE  // a chef has finished a dish
+} event_type;
+
+typedef struct {
+    long time; // in time units
+    long sequence; // breaks ties in the order the events were scheduled
+    event_type type;
+    int provider; // EVENT_PREP_DONE only
+    int chef;
+    int order;
+} sim_event;
+
+// Pending events in a binary min-heap on (time, sequence)
+typedef struct {
+    sim_event *events;
+    int count;
+    int capacity;
+    long nextSequence;
+} event_queue;
+
+// Where the timeline of the threads is written as Chrome trace JSON, chosen
+// with -T ("-" for stdout), NULL for none. The chefs have the first buffers
+// of the trace, then the providers. The simulation traces its virtual clock.
+const char *tracePath = NULL;
+trace_log trace;
+
+// The CPUs the threads are pinned to, chosen with -a. The chefs take the
+// first ones in order, then the providers.
+cpu_placement placement = {NULL, 0};
+
+// Sleeps for a number of time units
+void waitUnits(int units)
+{
+    struct timespec duration = {
+        .tv_sec = (long)units * timeUnitMs / 1000,
+        .tv_nsec = (long)units * timeUnitMs % 1000 * 1000000L,
+    };
+    while (nanosleep(&duration, &duration) != 0) {
+    }
+}
+
+// Sets endTime to now and returns the seconds since startTime
+double endTiming(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    return (endTime.tv_sec - startTime.tv_sec) +
+           (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+}
+
+// Returns the time a span starts, if tracing
+long traceBegin(void)
+{
+    return tracePath != NULL ? traceClock() : 0;
+}
+
+// Records a span of a thread which ends now, if tracing
+void traceEnd(int buffer, const char *name, long start_ns)
+{
+    if (tracePath != NULL) {
+        traceSpan(&trace.buffers[buffer], name, start_ns, traceClock());
+    }
+}
+
+// Records a span of the simulation, in time units of its virtual clock, if tracing
+void traceVirtual(int buffer, const char *name, long start, long end)
+{
+    if (tracePath != NULL) {
+        long unitNs = timeUnitMs * 1000000L;
+        traceSpan(&trace.buffers[buffer], name, trace.origin_ns + start * unitNs, trace.origin_ns + end * unitNs);
+    }
+}
+
+// Whether event a happens before event b
+int eventBefore(const sim_event *a, const sim_event *b)
+{
+    return a->time < b->time || (a->time == b->time && a->sequence < b->sequence);
+}
+
+// Schedules an event
+void eventPush(event_queue *queue, long time, event_type type, int provider, int chef, int order)
+{
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity > 0 ? 2 * queue->capacity : 16;
+        queue->events = realloc(queue->events, queue->capacity * sizeof(sim_event));
+        if (queue->events == NULL) {
+            perror("Event queue realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sim_event event = {time, queue->nextSequence++, type, provider, chef, order};
+    int i = queue->count++;
+    while (i > 0 && eventBefore(&event, &queue->events[(i - 1) / 2])) {
+        queue->events[i] = queue->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->events[i] = event;
+}
+
+// Takes the earliest event, returns 0 if there is none
+int eventPop(event_queue *queue, sim_event *event)
+{
+    if (queue->count == 0) {
+        return 0;
+    }
+    *event = queue->events[0];
+    sim_event last = queue->events[--queue->count];
+    int i = 0;
+    while (2 * i + 1 < queue->count) {
+        int child = 2 * i + 1;
+        if (child + 1 < queue->count && eventBefore(&queue->events[child + 1], &queue->events[child])) {
+            child++;
+        }
+        if (!eventBefore(&queue->events[child], &last)) {
+            break;
+        }
+        queue->events[i] = queue->events[child];
+        i = child;
+    }
+    queue->events[i] = last;
+    return 1;
+}
+
+// Adds an order at the bottom of a chef's deque
+void dequePush(order_deque *deque, int order)
+{
+    pthread_mutex_lock(&deque->lock);
+    deque->orders[deque->bottom++] = order;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Takes the newest order of a deque for its chef, returns 0 if it is empty
+int dequePop(order_deque *deque, int *order)
+{
+    pthread_mutex_lock(&deque->lock);
+    int found = deque->bottom > deque->top;
+    if (found) {
+        *order = deque->orders[--deque->bottom];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Takes the oldest order of a deque for another chef, returns 0 if it is empty
+int dequeSteal(order_deque *deque, int *order)
+{
+    pthread_mutex_lock(&deque->lock);
+    int found = deque->bottom > deque->top;
+    if (found) {
+        *order = deque->orders[deque->top++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Orders waiting in a deque
+int dequeSize(order_deque *deque)
+{
+    pthread_mutex_lock(&deque->lock);
+    int size = deque->bottom - deque->top;
+    pthread_mutex_unlock(&deque->lock);
+    return size;
+}
+
+// Looks once for an order a chef can cook: its own newest, or else the
+// oldest of another chef with the same ingredient set. Sets *from to the
+// chef the order was for. Returns 0 if none was found.
+int findOrder(int chefNumber, int *order, int *from)
+{
+    *from = chefNumber;
+    if (dequePop(&chefOrders[chefNumber], order)) {
+        return 1;
+    }
+    for (int step = 1; step < chefCount; ++step) {
+        int victim = (chefNumber + step) % chefCount;
+        if (victim % NUM_OFFERS == chefNumber % NUM_OFFERS && dequeSteal(&chefOrders[victim], order)) {
+            *from = victim;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Time units until a chef is done with all of its orders, from the dish it is
+// cooking to the ones the providers are still preparing for it. The caller
+// holds the mutex.
+int pendingWork(int chefNumber)
+{
+    return chefQueued[chefNumber] * cookingTimes[chefNumber];
+}
+
+// Moves an order a chef stole over to the thief's queue
+void chefStole(int chefNumber, int from)
+{
+    if (from != chefNumber) {
+        pthread_mutex_lock(&mutex);
+        chefQueued[from]--;
+        chefQueued[chefNumber]++;
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+// Whether the policy prefers chef a over chef b
+int policyPrefers(int a, int b)
+{
+    switch (policy) {
+        case POLICY_SJF:
+            return cookingTimes[a] < cookingTimes[b];
+        case POLICY_LPT:
+            return cookingTimes[a] > cookingTimes[b];
+        case POLICY_IDLE:
+            return pendingWork(a) < pendingWork(b);
+        default:
+            return 0;
+    }
+}
+
+// Picks the chef of the next order among those with dishes left to order.
+// The chefs are looked at from the one after the last pick on, so round-robin
+// takes the first one and ties of the other policies go round-robin too.
+// The caller holds the mutex.
+int pickChef(int lastChef)
+{
+    int best = -1;
+    for (int step = 1; step <= chefCount; ++step) {
+        int candidate = (lastChef + step) % chefCount;
+        if (chefOrdered[candidate] < dishesPerChef && (best < 0 || policyPrefers(candidate, best))) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+// Takes on the next order for a provider, returns its chef or -1 if all
+// orders are taken. The order number is set in *order.
+int takeOrder(int *order)
+{
+    pthread_mutex_lock(&mutex);
+    int chefNumber = -1;
+    if (ordersGiven < chefCount * dishesPerChef) {
+        *order = ordersGiven++;
+        chefNumber = lastPicked = pickChef(lastPicked);
+        chefOrdered[chefNumber]++;
+        chefQueued[chefNumber]++;
+    }
+    pthread_mutex_unlock(&mutex);
+    return chefNumber;
+}
+
 void *chef(void *pVoid)
 {
     // Get chef number, mapped to 0-based index
     int chefNumber = *(int*)(pVoid) - 1;
+    int offer = chefNumber % NUM_OFFERS;
 
-    for (int i = 0; i < DISHES_PER_CHEF; ++i)
+    while (1)
     {
         /////////////////////////////////////////////////
         // Implement your code for chef actions here.
         // Remember to include:
-        // - Waiting for ingredients
-        sem_wait(&semaphoreChefs[chefNumber]);
+        // - Waiting for ingredients of our set in any deque. Every post stands for an
+        //   order, or once the orders are closed, for the chef to stop. A search can
+        //   miss an order moving between deques, so it is repeated until the orders
+        //   are closed; one that fails after that means every order has been taken.
+        long waitStart = traceBegin();
+        sem_wait(&semaphoreOffers[offer]);
+        int order, from, found;
+        int closed;
+        do {
+            closed = __atomic_load_n(&ordersClosed, __ATOMIC_ACQUIRE);
+            found = findOrder(chefNumber, &order, &from);
+        } while (!found && !closed);
+        if (!found) {
+            break;
+        }
+        traceEnd(chefNumber, "wait for ingredients", waitStart);
+        chefStole(chefNumber, from);
         // - Printing received ingredients
-        printf("Chef %d received ingredients: %s\n", chefNumber + 1, providerOffers[chefNumber]);
+        if (from == chefNumber) {
+            printf("Chef %d received ingredients: %s\n", chefNumber + 1, providerOffers[offer]);
+        } else {
+            printf("Chef %d received ingredients: %s (stolen from Chef %d)\n", chefNumber + 1, providerOffers[offer], from + 1);
+        }
         // - Simulating preparation and cooking time
-        sleep(cookingTimes[chefNumber]);
+        long cookStart = traceBegin();
+        waitUnits(cookingTimes[chefNumber]);
+        traceEnd(chefNumber, "cook", cookStart);
         // - Updating cook count and total cooking time
         pthread_mutex_lock(&mutex);
-        chefCookCount[chefNumber]++;
-        totalCookingTime += cookingTimes[chefNumber];
+        int dish = ++chefCookCount[chefNumber];
+        chefQueued[chefNumber]--;
+        totalCookingTime += cookingTimes[chefNumber] * timeUnitMs / 1000.0;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        chefDoneTime[chefNumber] = (now.tv_sec - startTime.tv_sec) + (now.tv_nsec - startTime.tv_nsec) / 1e9;
         pthread_mutex_unlock(&mutex);
         // - Printing finished cooking
-        printf("Chef %d finished cooking dish %d\n", chefNumber + 1, i + 1);
+        printf("Chef %d finished cooking dish %d\n", chefNumber + 1, dish);
         // - Signaling finish
         sem_post(&semaphoreFinish);
         /////////////////////////////////////////////////
     }
-    
+
     pthread_exit(NULL);
 }
 
@@ -60,7 +393,7 @@ void *provider(void *pVoid)
 {
     /////////////////////////////////////////////////
     // Implement your code for provider initialization here.
-    int nextChef = 0;
+    int providerNumber = *(int*)(pVoid) - 1;
     /////////////////////////////////////////////////
 
     while (1)
@@ -68,108 +401,437 @@ void *provider(void *pVoid)
         /////////////////////////////////////////////////
         // Implement your code for provider actions here.
         // Remember to include:
-        // - Checking if all chefs are done
-        pthread_mutex_lock(&mutex);
-        if (chefCookCount[0] == DISHES_PER_CHEF && chefCookCount[1] == DISHES_PER_CHEF && chefCookCount[2] == DISHES_PER_CHEF)
-        {
-            allCooked = 1;
-            pthread_mutex_unlock(&mutex);
+        // - Waiting until fewer than ordersInFlight dishes are cooking or waiting
+        //   to be cooked, with 1 this waits for the chef of the last order
+        long waitStart = traceBegin();
+        sem_wait(&semaphoreFinish);
+        traceEnd(chefCount + providerNumber, "wait for order slot", waitStart);
+        // - Selecting the next chef, and checking if all orders are taken
+        int order;
+        int nextChef = takeOrder(&order);
+        if (nextChef < 0) {
+            sem_post(&semaphoreFinish); // for the other providers
             break;
         }
-        pthread_mutex_unlock(&mutex);
         // - Offering ingredients
-        printf("Provider preparing ingredients for Chef %d: %s\n", nextChef + 1, providerOffers[nextChef]);
-        sleep(providerPrepTime);
+        printf("Provider %d preparing ingredients for Chef %d: %s\n", providerNumber + 1, nextChef + 1,
+               providerOffers[nextChef % NUM_OFFERS]);
+        long prepStart = traceBegin();
+        waitUnits(providerPrepTime);
         // - Simulating preparation time
-        sleep(providerPrepTime);
-        // - Signaling chef to start cooking
-        sem_post(&semaphoreChefs[nextChef]);
-        // - Waiting for chef to finish
-        sem_wait(&semaphoreFinish);
-        // - Selecting the next chef
-        nextChef = (nextChef + 1) % NUM_CHEFS;
+        waitUnits(providerPrepTime);
+        traceEnd(chefCount + providerNumber, "prep", prepStart);
+        // - Signaling a chef to start cooking
+        dequePush(&chefOrders[nextChef], order);
+        providerOrderCount[providerNumber]++;
+        sem_post(&semaphoreOffers[nextChef % NUM_OFFERS]);
         /////////////////////////////////////////////////
     }
 
     return NULL;
 }
 
-int main(void)
+// The state of the simulated kitchen, following the threads: the providers
+// and each chef are busy until their next event.
+typedef struct {
+    event_queue queue;
+    long now;
+    int freeOrders; // like semaphoreFinish
+    int *providerBusy;
+    int *chefBusy;
+} kitchen_sim;
+
+// Lets the idle providers start on the next orders while they are free to
+void simProviders(kitchen_sim *sim)
+{
+    for (int p = 0; p < providerCount && sim->freeOrders > 0; ++p) {
+        if (sim->providerBusy[p]) {
+            continue;
+        }
+        int order;
+        int nextChef = takeOrder(&order);
+        if (nextChef < 0) {
+            return;
+        }
+        sim->freeOrders--;
+        sim->providerBusy[p] = 1;
+        printf("Provider %d preparing ingredients for Chef %d: %s\n", p + 1, nextChef + 1, providerOffers[nextChef % NUM_OFFERS]);
+        eventPush(&sim->queue, sim->now + 2 * providerPrepTime, EVENT_PREP_DONE, p, nextChef, order);
+    }
+}
+
+// Lets a chef start cooking if it is idle and finds an order
+void simChef(kitchen_sim *sim, int chefNumber)
+{
+    int order, from;
+    if (sim->chefBusy[chefNumber] || !findOrder(chefNumber, &order, &from)) {
+        return;
+    }
+    sim->chefBusy[chefNumber] = 1;
+    chefStole(chefNumber, from);
+    if (from == chefNumber) {
+        printf("Chef %d received ingredients: %s\n", chefNumber + 1, providerOffers[chefNumber % NUM_OFFERS]);
+    } else {
+        printf("Chef %d received ingredients: %s (stolen from Chef %d)\n", chefNumber + 1,
+               providerOffers[chefNumber % NUM_OFFERS], from + 1);
+    }
+    eventPush(&sim->queue, sim->now + cookingTimes[chefNumber], EVENT_COOK_DONE, -1, chefNumber, order);
+}
+
+// Runs the kitchen on a virtual clock, returns its running time in seconds
+double simulateKitchen(void)
+{
+    kitchen_sim sim = {.freeOrders = ordersInFlight};
+    sim.providerBusy = calloc(providerCount, sizeof(int));
+    sim.chefBusy = calloc(chefCount, sizeof(int));
+    simProviders(&sim);
+
+    sim_event event;
+    while (eventPop(&sim.queue, &event)) {
+        sim.now = event.time;
+        switch (event.type) {
+            case EVENT_PREP_DONE:
+                sim.providerBusy[event.provider] = 0;
+                traceVirtual(chefCount + event.provider, "prep", sim.now - 2 * providerPrepTime, sim.now);
+                providerOrderCount[event.provider]++;
+                dequePush(&chefOrders[event.chef], event.order);
+                // The chef of the order takes it if idle, else an idle chef of the same set steals it
+                simChef(&sim, event.chef);
+                for (int step = 1; step < chefCount && dequeSize(&chefOrders[event.chef]) > 0; ++step) {
+                    int thief = (event.chef + step) % chefCount;
+                    if (thief % NUM_OFFERS == event.chef % NUM_OFFERS) {
+                        simChef(&sim, thief);
+                    }
+                }
+                break;
+            case EVENT_COOK_DONE:
+                sim.chefBusy[event.chef] = 0;
+                traceVirtual(event.chef, "cook", sim.now - cookingTimes[event.chef], sim.now);
+                chefCookCount[event.chef]++;
+                chefQueued[event.chef]--;
+                totalCookingTime += cookingTimes[event.chef] * timeUnitMs / 1000.0;
+                chefDoneTime[event.chef] = sim.now * timeUnitMs / 1000.0;
+                printf("Chef %d finished cooking dish %d\n", event.chef + 1, chefCookCount[event.chef]);
+                sim.freeOrders++;
+                simChef(&sim, event.chef);
+                break;
+        }
+        simProviders(&sim);
+    }
+    allCooked = 1;
+
+    free(sim.queue.events);
+    free(sim.providerBusy);
+    free(sim.chefBusy);
+    return sim.now * timeUnitMs / 1000.0;
+}
+
+// Fills cookingTimes from a comma separated list, repeated over the chefs.
+// Returns the number of times in the list, or -1 if it is empty or has
+// a time which is not a non-negative number.
+int parseCookingTimes(const char *list)
+{
+    char *copy = strdup(list);
+    int *times = malloc((strlen(list) / 2 + 1) * sizeof(int)); // a list of n times has at least 2n - 1 characters
+    int count = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (parseNumber(item, &times[count]) != 0 || times[count] < 0) {
+            count = -1;
+            break;
+        }
+        ++count;
+    }
+    for (int i = 0; i < chefCount && count > 0; ++i) {
+        cookingTimes[i] = times[i % count];
+    }
+    free(times);
+    free(copy);
+    return count > 0 ? count : -1;
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-a none|compact|scatter|<cpu_list>] [-m threads|sim] [-s rr|sjf|lpt|idle] [-p orders_in_flight] [-u time_unit_ms] "
+            "[-c chefs] [-P providers] [-d dishes_per_chef] [-t cooking_times] [-r prep_time] [-T trace.json]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
 {
     setvbuf(stdout, NULL, _IOLBF, 0);
 
+    const char *cookingTimeList = DEFAULT_COOKING_TIMES;
+    int customCookingTimes = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:u:m:s:c:P:d:t:r:T:")) != -1) {
+        switch (opt) {
+            case 'p':
+                if (parseNumber(optarg, &ordersInFlight) != 0) {
+                    fprintf(stderr, "Invalid number %s for -p\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                if (parseNumber(optarg, &timeUnitMs) != 0) {
+                    fprintf(stderr, "Invalid number %s for -u\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                if (parseNumber(optarg, &chefCount) != 0) {
+                    fprintf(stderr, "Invalid number %s for -c\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                if (parseNumber(optarg, &providerCount) != 0) {
+                    fprintf(stderr, "Invalid number %s for -P\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                if (parseNumber(optarg, &dishesPerChef) != 0) {
+                    fprintf(stderr, "Invalid number %s for -d\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                cookingTimeList = optarg;
+                customCookingTimes = 1;
+                break;
+            case 'r':
+                if (parseNumber(optarg, &providerPrepTime) != 0) {
+                    fprintf(stderr, "Invalid number %s for -r\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            case 's':
+                policy = POLICY_COUNT;
+                for (int p = 0; p < POLICY_COUNT; ++p) {
+                    if (strcmp(optarg, policyNames[p]) == 0) {
+                        policy = p;
+                    }
+                }
+                if (policy == POLICY_COUNT) {
+                    fprintf(stderr, "Unknown policy %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                mode = MODE_COUNT;
+                for (int m = 0; m < MODE_COUNT; ++m) {
+                    if (strcmp(optarg, modeNames[m]) == 0) {
+                        mode = m;
+                    }
+                }
+                if (mode == MODE_COUNT) {
+                    fprintf(stderr, "Unknown mode %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                if (placementParse(&placement, optarg) != 0) {
+                    fprintf(stderr, "Invalid placement %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc || ordersInFlight < 1 || timeUnitMs < 0 || chefCount < 1 || providerCount < 1
+        || dishesPerChef < 0 || providerPrepTime < 0) {
+        usage(argv[0]);
+    }
+    cookingTimes = malloc(chefCount * sizeof(int));
+    int cookingTimeCount = parseCookingTimes(cookingTimeList);
+    if (cookingTimeCount < 0) {
+        fprintf(stderr, "Invalid cooking times %s\n", cookingTimeList);
+        exit(EXIT_FAILURE);
+    }
+    // The default list may be longer than the kitchen, a given one may not
+    if (customCookingTimes && cookingTimeCount > chefCount) {
+        fprintf(stderr, "%d cooking times given for %d chefs\n", cookingTimeCount, chefCount);
+        exit(EXIT_FAILURE);
+    }
+
     srand(time(NULL));
 
     // Initialize shared variables
     /////////////////////////////////////////////////
     allCooked = 0;
     totalCookingTime = 0.0;
-    for (int i = 0; i < NUM_CHEFS; ++i) {
-        chefCookCount[i] = 0; // Initialize each chef's dish count to 0
+    ordersGiven = 0;
+    lastPicked = chefCount - 1;
+    chefOrders = malloc(chefCount * sizeof(order_deque));
+    chefCookCount = calloc(chefCount, sizeof(int)); // Initialize each chef's dish count to 0
+    chefOrdered = calloc(chefCount, sizeof(int));
+    chefQueued = calloc(chefCount, sizeof(int));
+    chefDoneTime = calloc(chefCount, sizeof(double));
+    providerOrderCount = calloc(providerCount, sizeof(int));
+    for (int i = 0; i < chefCount; ++i) {
+        pthread_mutex_init(&chefOrders[i].lock, NULL);
+        chefOrders[i].orders = malloc((dishesPerChef > 0 ? dishesPerChef : 1) * sizeof(int));
+        chefOrders[i].top = 0;
+        chefOrders[i].bottom = 0;
     }
     // Implement your code to initialize shared variables here.
     /////////////////////////////////////////////////
-    
+
 
     // Initialize semaphores
     /////////////////////////////////////////////////
-    for (int i = 0; i < NUM_CHEFS; i++)
+    for (int i = 0; i < NUM_OFFERS; i++)
     {
-        sem_init(&semaphoreChefs[i], 0, 0);
+        sem_init(&semaphoreOffers[i], 0, 0);
     }
-    sem_init(&semaphoreFinish, 0, 0);
+    sem_init(&semaphoreFinish, 0, ordersInFlight);
     sem_init(&providerReady, 0, 1);
 
-    pthread_t chefThreads[NUM_CHEFS], providerThread;
-    int chefNumbers[NUM_CHEFS] = {1, 2, 3};
+    pthread_t *chefThreads = malloc(chefCount * sizeof(pthread_t));
+    pthread_t *providerThreads = malloc(providerCount * sizeof(pthread_t));
+    int *chefNumbers = malloc(chefCount * sizeof(int));
+    int *providerNumbers = malloc(providerCount * sizeof(int));
+    for (int i = 0; i < chefCount; ++i) {
+        chefNumbers[i] = i + 1;
+    }
+    for (int i = 0; i < providerCount; ++i) {
+        providerNumbers[i] = i + 1;
+    }
 
     // Implement your code to initialize semaphores here.
     /////////////////////////////////////////////////
-    
+
+
+    if (tracePath != NULL) {
+        traceStart(&trace, chefCount + providerCount);
+        for (int i = 0; i < chefCount; ++i) {
+            traceName(&trace.buffers[i], "Chef %d", i + 1);
+        }
+        for (int i = 0; i < providerCount; ++i) {
+            traceName(&trace.buffers[chefCount + i], "Provider %d", i + 1);
+        }
+    }
 
     // Start timing
     clock_gettime(CLOCK_MONOTONIC, &startTime);
 
 
-    // Create chef and provider threads
-    /////////////////////////////////////////////////
-    for (int i = 0; i < NUM_CHEFS; ++i) {
-        pthread_create(&chefThreads[i], NULL, chef, &chefNumbers[i]);
-    }
-    pthread_create(&providerThread, NULL, provider, NULL);
-    // Implement your code to create threads here.
-    /////////////////////////////////////////////////
-
+    // The running time is the virtual one when simulating, the wall time otherwise
+    double totalTime, wallTime;
+    if (mode == MODE_SIM) {
+        totalTime = simulateKitchen();
+        // End timing
+        wallTime = endTiming();
+    } else {
+        // Create chef and provider threads
+        /////////////////////////////////////////////////
+        pthread_attr_t attr;
+        for (int i = 0; i < chefCount; ++i) {
+            placementAttr(&placement, i, &attr);
+            pthread_create(&chefThreads[i], &attr, chef, &chefNumbers[i]);
+            pthread_attr_destroy(&attr);
+        }
+        for (int i = 0; i < providerCount; ++i) {
+            placementAttr(&placement, chefCount + i, &attr);
+            pthread_create(&providerThreads[i], &attr, provider, &providerNumbers[i]);
+            pthread_attr_destroy(&attr);
+        }
+        // Implement your code to create threads here.
+        /////////////////////////////////////////////////
 
-    // Join threads
-    /////////////////////////////////////////////////
-    for (int i = 0; i < NUM_CHEFS; ++i) {
-        pthread_join(chefThreads[i], NULL);
-    }
-    pthread_join(providerThread, NULL);
-    // Implement your code to join threads here.
-    /////////////////////////////////////////////////
 
-    // End timing
-    clock_gettime(CLOCK_MONOTONIC, &endTime);
+        // Join threads
+        /////////////////////////////////////////////////
+        for (int i = 0; i < providerCount; ++i) {
+            pthread_join(providerThreads[i], NULL);
+        }
+        // No order comes after this, wake every chef once more so each finds
+        // the deques of its set empty and stops.
+        __atomic_store_n(&ordersClosed, 1, __ATOMIC_RELEASE);
+        for (int i = 0; i < chefCount; ++i) {
+            sem_post(&semaphoreOffers[i % NUM_OFFERS]);
+        }
+        for (int i = 0; i < chefCount; ++i) {
+            pthread_join(chefThreads[i], NULL);
+        }
+        allCooked = 1;
+        // Implement your code to join threads here.
+        /////////////////////////////////////////////////
 
-    double totalTime = (endTime.tv_sec - startTime.tv_sec) + 
-                       (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+        // End timing
+        wallTime = endTiming();
+        totalTime = wallTime;
+    }
 
     printf("All chefs have finished cooking.\n");
     printf("Total running time: %.2f seconds\n", totalTime);
-    printf("Total cumulative cooking time (including ingredient wait time): %.2f seconds\n", totalCookingTime);
+    printf("Total cumulative cooking time of all chefs: %.2f seconds\n", totalCookingTime);
+
+    // The strictly serial schedule prepares and cooks one dish at a time
+    long serialUnits = 0;
+    for (int i = 0; i < chefCount; ++i) {
+        serialUnits += (long)dishesPerChef * (2 * providerPrepTime + cookingTimes[i]);
+    }
+    double serialTime = serialUnits * timeUnitMs / 1000.0;
+    printf("Serial schedule running time: %.2f seconds, %d orders in flight took %.1f%% of it (%.2fx speedup)\n",
+           serialTime, ordersInFlight, serialTime > 0 ? 100.0 * totalTime / serialTime : 0.0,
+           totalTime > 0 ? serialTime / totalTime : 0.0);
+
+    // Makespan and how busy everyone was, with the idle time being the rest of the makespan
+    printf("Policy %s, %d chefs, %d providers, makespan %.2f seconds, %.2f dishes per second\n", policyNames[policy],
+           chefCount, providerCount, totalTime, totalTime > 0 ? chefCount * dishesPerChef / totalTime : 0.0);
+    for (int i = 0; i < chefCount; ++i) {
+        double busyTime = chefCookCount[i] * cookingTimes[i] * timeUnitMs / 1000.0;
+        printf("Chef %d: %d dishes, busy %.2f seconds, idle %.2f seconds, utilization %.1f%%, last dish at %.2f seconds\n",
+               i + 1, chefCookCount[i], busyTime, totalTime - busyTime, totalTime > 0 ? 100.0 * busyTime / totalTime : 0.0,
+               chefDoneTime[i]);
+    }
+    for (int i = 0; i < providerCount; ++i) {
+        double providerBusyTime = providerOrderCount[i] * 2 * providerPrepTime * timeUnitMs / 1000.0;
+        printf("Provider %d: %d orders, busy %.2f seconds, idle %.2f seconds, utilization %.1f%%\n",
+               i + 1, providerOrderCount[i], providerBusyTime, totalTime - providerBusyTime,
+               totalTime > 0 ? 100.0 * providerBusyTime / totalTime : 0.0);
+    }
+    if (tracePath != NULL) {
+        if (traceWrite(&trace, tracePath) != 0) {
+            perror("Trace write failed");
+        }
+        traceFree(&trace);
+    }
+    if (mode == MODE_SIM) {
+        printf("Simulated in %.3f milliseconds of real time\n", wallTime * 1000);
+    }
 
     // Clean up
     /////////////////////////////////////////////////
-    for (int i = 0; i < NUM_CHEFS; ++i) {
-        sem_destroy(&semaphoreChefs[i]);
+    for (int i = 0; i < NUM_OFFERS; ++i) {
+        sem_destroy(&semaphoreOffers[i]);
+    }
+    for (int i = 0; i < chefCount; ++i) {
+        pthread_mutex_destroy(&chefOrders[i].lock);
+        free(chefOrders[i].orders);
     }
     sem_destroy(&semaphoreFinish);
     sem_destroy(&providerReady);
     pthread_mutex_destroy(&mutex);
+    placementFree(&placement);
+    free(chefOrders);
+    free(chefCookCount);
+    free(chefOrdered);
+    free(chefQueued);
+    free(chefDoneTime);
+    free(providerOrderCount);
+    free(cookingTimes);
+    free(chefThreads);
+    free(providerThreads);
+    free(chefNumbers);
+    free(providerNumbers);
     // Implement your code to destroy semaphores and mutex here.
     /////////////////////////////////////////////////
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LIST_MAX 32 // values per swept option
+#define CSV_HEADER "label,engine,layout,digits,threads,batch,operations,repeat,seconds,ops_per_s\n"
+
+// The problem1 configurations to time: every combination of the lists.
+typedef struct {
+	char *engines[LIST_MAX];
+	int engine_count;
+	char *layouts[LIST_MAX];
+	int layout_count;
+	char *batches[LIST_MAX];
+	int batch_count;
+	int digits;
+	int threads; // 0 for one per digit, like problem1
+	long operations; // per thread
+	int repeats;
+} ring_sweep;
+
+/**
+ * @brief Runs problem1 once with its output thrown away.
+ *
+ * @param problem1 : The binary.
+ * @param sweep : The digits, threads and operations.
+ * @param engine : The -e value.
+ * @param layout : The -l value.
+ * @param batch : The -b value.
+ * @return The seconds it took.
+ */
+double runProblem1(const char *problem1, const ring_sweep *sweep, const char *engine, const char *layout, const char *batch);
+
+/**
+ * @brief Splits a comma separated list in place.
+ *
+ * @param text : The list, its commas are overwritten.
+ * @param items : Set to the items.
+ * @return The number of items.
+ */
+int splitList(char *text, char **items);
+
+/**
+ * @brief Returns the monotonic clock in seconds.
+ */
+double now(void);
+
+static void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-e engines] [-p layouts] [-b batches] [-d digits] [-t threads] [-n operations] [-r repeats] [-L label] [-x problem1] [-o csv_file]\n", program);
+	fprintf(stderr, "Lists are comma separated, e.g. -e sem,cas -b 1,16,256\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	char default_engines[] = "sem,cas,fc";
+	char default_layouts[] = "packed";
+	char default_batches[] = "1,4,16,64,256";
+	ring_sweep sweep = {.digits = 9, .threads = 0, .operations = 1000000, .repeats = 3};
+	sweep.engine_count = splitList(default_engines, sweep.engines);
+	sweep.layout_count = splitList(default_layouts, sweep.layouts);
+	sweep.batch_count = splitList(default_batches, sweep.batches);
+	const char *label = "";
+	const char *problem1 = "./problem1";
+	const char *csv_name = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:p:b:d:t:n:r:L:x:o:")) != -1) {
+		switch (opt) {
+			case 'e':
+				sweep.engine_count = splitList(optarg, sweep.engines);
+				break;
+			case 'p':
+				sweep.layout_count = splitList(optarg, sweep.layouts);
+				break;
+			case 'b':
+				sweep.batch_count = splitList(optarg, sweep.batches);
+				break;
+			case 'd':
+				sweep.digits = atoi(optarg);
+				break;
+			case 't':
+				sweep.threads = atoi(optarg);
+				break;
+			case 'n':
+				sweep.operations = atol(optarg);
+				break;
+			case 'r':
+				sweep.repeats = atoi(optarg);
+				break;
+			case 'L':
+				label = optarg;
+				break;
+			case 'x':
+				problem1 = optarg;
+				break;
+			case 'o':
+				csv_name = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc || sweep.repeats < 1 || sweep.operations < 0) {
+		usage(argv[0]);
+	}
+	if (access(problem1, X_OK) != 0) {
+		fprintf(stderr, "%s is not executable\n", problem1);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *csv = stdout;
+	if (csv_name != NULL) {
+		// Rows are appended so runs of several commits end up in one file.
+		csv = fopen(csv_name, "a");
+		if (csv == NULL) {
+			perror("CSV open failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fseek(csv, 0, SEEK_END);
+	if (ftell(csv) <= 0) {
+		fprintf(csv, CSV_HEADER);
+	}
+
+	long total_operations = (long)(sweep.threads > 0 ? sweep.threads : sweep.digits) * sweep.operations;
+	for (int e = 0; e < sweep.engine_count; ++e) {
+		for (int l = 0; l < sweep.layout_count; ++l) {
+			for (int b = 0; b < sweep.batch_count; ++b) {
+				for (int repeat = 0; repeat < sweep.repeats; ++repeat) {
+					double seconds = runProblem1(problem1, &sweep, sweep.engines[e], sweep.layouts[l], sweep.batches[b]);
+					fprintf(csv, "%s,%s,%s,%d,%d,%s,%ld,%d,%.6f,%.0f\n", label, sweep.engines[e], sweep.layouts[l],
+						sweep.digits, sweep.threads, sweep.batches[b], total_operations, repeat, seconds, total_operations / seconds);
+					fflush(csv);
+				}
+			}
+		}
+	}
+
+	if (csv != stdout) {
+		fclose(csv);
+	}
+	return 0;
+}
+
+/**
+ * @brief Runs problem1 once with its output thrown away.
+ *
+ * @param problem1 : The binary.
+ * @param sweep : The digits, threads and operations.
+ * @param engine : The -e value.
+ * @param layout : The -l value.
+ * @param batch : The -b value.
+ * @return The seconds it took.
+ */
+double runProblem1(const char *problem1, const ring_sweep *sweep, const char *engine, const char *layout, const char *batch) {
+	char digits[16], threads[16], operations[32];
+	snprintf(digits, sizeof(digits), "%d", sweep->digits);
+	snprintf(threads, sizeof(threads), "%d", sweep->threads);
+	snprintf(operations, sizeof(operations), "%ld", sweep->operations);
+
+	double start = now();
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork failed");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(problem1, problem1, "-v", "off", "-e", engine, "-l", layout, "-b", batch,
+			"-d", digits, "-t", threads, "1", operations, (char *)NULL);
+		perror("problem1 exec failed");
+		exit(EXIT_FAILURE);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s -e %s -l %s -b %s failed\n", problem1, engine, layout, batch);
+		exit(EXIT_FAILURE);
+	}
+	return now() - start;
+}
+
+/**
+ * @brief Splits a comma separated list in place.
+ *
+ * @param text : The list, its commas are overwritten.
+ * @param items : Set to the items.
+ * @return The number of items.
+ */
+int splitList(char *text, char **items) {
+	int count = 0;
+	for (char *item = strtok(text, ","); item != NULL && count < LIST_MAX; item = strtok(NULL, ",")) {
+		items[count++] = item;
+	}
+	return count;
+}
+
+/**
+ * @brief Returns the monotonic clock in seconds.
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
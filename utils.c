@@ -1,6 +1,249 @@
+#define _GNU_SOURCE // CPU affinity of threads
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "utils.h"
+
+// A kernel counts the words starting in text[0..length) and updates
+// *in_word, which says if the char before the text was part of a word.
+typedef long (*word_kernel)(const char *text, long length, int *in_word);
+
+static long wordKernelScalar(const char *text, long length, int *in_word);
+static long wordKernelSelect(const char *text, long length, int *in_word);
+
+// Starts with the selector, which swaps in the best kernel on first use.
+static word_kernel word_kernel_fn = wordKernelSelect;
+static const char *word_kernel_name = NULL;
+
+/**
+* Counts word starts one char at a time, used for the tails
+* of the vector kernels and on CPUs without them.
+*/
+static long wordKernelScalar(const char *text, long length, int *in_word) {
+	long words = 0;
+	int inside = *in_word;
+	for (long i = 0; i < length; i++) {
+		if (text[i] == ' ' || text[i] == '\n') {
+			inside = 0;
+		} else if (!inside) {
+			// a word starts here, count it only once however it is chunked
+			inside = 1;
+			words++;
+		}
+	}
+	*in_word = inside;
+	return words;
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+* Classifies 16 chars at a time into a separator mask. A word starts
+* at every non separator whose previous char is a separator, so the
+* starts of a block are ~sep & (sep << 1 | carry from the last block).
+*/
+__attribute__((target("sse2")))
+static long wordKernelSse2(const char *text, long length, int *in_word) {
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i newline = _mm_set1_epi8('\n');
+	unsigned int carry = *in_word ? 0 : 1; // 1 if the previous char was a separator
+	long words = 0;
+	long i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i sep = _mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, newline));
+		unsigned int sep_mask = (unsigned int)_mm_movemask_epi8(sep);
+		unsigned int starts = ~sep_mask & ((sep_mask << 1) | carry) & 0xFFFF;
+		words += __builtin_popcount(starts);
+		carry = (sep_mask >> 15) & 1;
+	}
+	*in_word = !carry;
+	return words + wordKernelScalar(text + i, length - i, in_word);
+}
+
+/**
+* Same as wordKernelSse2 with 32 chars per step.
+*/
+__attribute__((target("avx2,popcnt")))
+static long wordKernelAvx2(const char *text, long length, int *in_word) {
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i newline = _mm256_set1_epi8('\n');
+	unsigned int carry = *in_word ? 0 : 1;
+	long words = 0;
+	long i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i sep = _mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, newline));
+		unsigned int sep_mask = (unsigned int)_mm256_movemask_epi8(sep);
+		unsigned int starts = ~sep_mask & ((sep_mask << 1) | carry);
+		words += _mm_popcnt_u32(starts);
+		carry = sep_mask >> 31;
+	}
+	*in_word = !carry;
+	return words + wordKernelScalar(text + i, length - i, in_word);
+}
+#endif
+
+/**
+* Picks the fastest kernel this CPU supports (cpuid) the first
+* time a text is fed, then hands over to it.
+*/
+static long wordKernelSelect(const char *text, long length, int *in_word) {
+	wordCounterKernel(NULL);
+	return word_kernel_fn(text, length, in_word);
+}
+
+/**
+* Chooses the kernel used by wordCounterFeed. By default the
+* fastest one the CPU supports is picked on first use.
+*
+* @param name: "scalar", "sse2", "avx2", or NULL for the default.
+*
+* @returns the name of the kernel in use, or NULL if the requested
+* kernel is unknown or not supported by this CPU.
+*/
+const char *wordCounterKernel(const char *name) {
+	word_kernel kernel = wordKernelScalar;
+	const char *kernel_name = "scalar";
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	int has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+	int has_sse2 = __builtin_cpu_supports("sse2");
+	if (name == NULL) {
+		name = has_avx2 ? "avx2" : has_sse2 ? "sse2" : "scalar";
+	}
+	if (strcmp(name, "avx2") == 0 && has_avx2) {
+		kernel = wordKernelAvx2;
+		kernel_name = "avx2";
+	} else if (strcmp(name, "sse2") == 0 && has_sse2) {
+		kernel = wordKernelSse2;
+		kernel_name = "sse2";
+	} else if (strcmp(name, "scalar") != 0) {
+		return NULL;
+	}
+#else
+	if (name != NULL && strcmp(name, "scalar") != 0) {
+		return NULL;
+	}
+#endif
+	word_kernel_fn = kernel;
+	word_kernel_name = kernel_name;
+	return word_kernel_name;
+}
+
+/**
+* Prepares a word counter for a new text.
+*
+* @param counter: the counter to reset.
+* @param min_long_length: also count the words with at least this
+* many chars in counter->long_words, or 0 to only count words.
+*/
+void wordCounterInit(word_counter *counter, int min_long_length) {
+	counter->words = 0;
+	counter->in_word = 0;
+	counter->min_long_length = min_long_length;
+	counter->word_length = 0;
+	counter->long_words = 0;
+}
+
+/**
+* Counts words and long words in one pass over the chars, in place.
+* The length of the current word is kept in the counter, so a long
+* word split between two chunks is still counted once, when it ends.
+*/
+static void wordCounterFeedLong(word_counter *counter, const char *text, long length) {
+	long words = counter->words;
+	long long_words = counter->long_words;
+	long word_length = counter->word_length;
+	long min_length = counter->min_long_length;
+	for (long i = 0; i < length; i++) {
+		if (text[i] == ' ' || text[i] == '\n') {
+			if (word_length >= min_length) {
+				long_words++;
+			}
+			word_length = 0;
+		} else if (word_length++ == 0) {
+			words++;
+		}
+	}
+	counter->words = words;
+	counter->long_words = long_words;
+	counter->word_length = word_length;
+	counter->in_word = word_length > 0;
+}
+
+/**
+* Feeds the next <length> chars of the text to the counter.
+* Words are separated by spaces and newline characters.
+*
+* @param counter: the counter of the text.
+* @param text: the next chars of the text, no null terminator needed.
+* @param length: the number of chars to feed.
+*/
+void wordCounterFeed(word_counter *counter, const char *text, long length) {
+	if (counter->min_long_length > 0) {
+		wordCounterFeedLong(counter, text, length);
+	} else {
+		counter->words += word_kernel_fn(text, length, &counter->in_word);
+	}
+}
+
+/**
+* Moves the counter over chars without counting them, so that it is
+* in the right state for the chars that follow. Lets a text be cut
+* into chunks which are counted separately (e.g. in parallel) and
+* then summed: each chunk starts from the state of the one before.
+*
+* @param counter: the counter of the text.
+* @param text: the chars to skip, no null terminator needed.
+* @param length: the number of chars to skip.
+*/
+void wordCounterSkip(word_counter *counter, const char *text, long length) {
+	if (length <= 0) {
+		return;
+	}
+	// Only the word running into the end of the chars matters.
+	long i = length;
+	while (i > 0 && text[i - 1] != ' ' && text[i - 1] != '\n') {
+		i--;
+	}
+	if (i > 0) {
+		counter->word_length = length - i;
+	} else {
+		counter->word_length += length;
+	}
+	counter->in_word = counter->word_length > 0;
+}
+
+/**
+* Ends the text, which also ends its last word. The total number
+* of long words is in counter->long_words afterwards.
+* The counter can be fed again after wordCounterInit.
+*
+* @param counter: the counter of the text.
+*
+* @returns the total number of words in the text.
+*/
+long wordCounterFinish(word_counter *counter) {
+	if (counter->min_long_length > 0 && counter->word_length >= counter->min_long_length) {
+		counter->long_words++;
+	}
+	counter->word_length = 0;
+	counter->in_word = 0;
+	return counter->words;
+}
 
 /**
 * Counts the words in the string in a simple manner.
@@ -12,18 +255,43 @@
 * @returns the total number of words in the string.
 */
 int wordCount(char *text) {
-	int counter = 0;
-	int i=0;
-	while(text[i] != '\0'){
-		if (text[i] == ' ' || text[i] == '\n'){
-			counter++;
-		}
-		i++;
-	}
-	printf("\n");
-	return counter + 1;
+	return wordCountRange(text, strlen(text));
 }
 
+/**
+* Counts the words in the first <length> chars of a buffer
+* which does not have to be null terminated, e.g. a file
+* mapped into memory. Uses the same rules as wordCount.
+*
+* @param text: the buffer to count the words in.
+* @param length: the number of chars in the buffer.
+* 
+* @returns the total number of words in the buffer.
+*/
+int wordCountRange(const char *text, long length) {
+	word_counter counter;
+	wordCounterInit(&counter, 0);
+	wordCounterFeed(&counter, text, length);
+	return wordCounterFinish(&counter);
+}
+
+/**
+* Counts the words with at least <min_length> chars in the first
+* <length> chars of a buffer, in place and in a single pass.
+*
+* @param text: the buffer to count the long words in.
+* @param length: the number of chars in the buffer.
+* @param min_length: the length from which a word is long.
+* 
+* @returns the number of long words in the buffer.
+*/
+int countLongWords(const char *text, long length, int min_length) {
+	word_counter counter;
+	wordCounterInit(&counter, min_length);
+	wordCounterFeed(&counter, text, length);
+	wordCounterFinish(&counter);
+	return counter.long_words;
+}
 
 /**
 * Checks if the <input_file> is a txt file or not
@@ -82,4 +350,589 @@ void saveResult(char *fileName, int result)
    fprintf(fp, "%d", result);
 
    fclose(fp);
-}
\ No newline at end of file
+}
+
+/**
+ * Saves a result given as a string to a given textfile,
+ * e.g. a number with too many digits for an int.
+ * 
+ * @param fileName: The textfile name to save the result.
+ * 
+ * @param result: The string to be kept.
+ */
+void saveResultString(char *fileName, const char *result)
+{
+	FILE * fp;
+
+   fp = fopen (fileName, "w");
+   fprintf(fp, "%s", result);
+
+   fclose(fp);
+}
+
+/**
+* Parses a whole decimal number which fits an int, for the options
+* of the programs.
+*
+* @param text: the number.
+* @param value: set to the number, unchanged if it is invalid.
+*
+* @returns 0, or -1 if the text is not a number or out of range.
+*/
+int parseNumber(const char *text, int *value) {
+	char *end;
+	errno = 0;
+	long number = strtol(text, &end, 10);
+	if (errno != 0 || end == text || *end != '\0' || number < INT_MIN || number > INT_MAX) {
+		return -1;
+	}
+	*value = number;
+	return 0;
+}
+
+#define LOG_LINE_MAX 256 // longer log lines are cut
+#define LOG_FLUSH_INTERVAL_NS 1000000 // the flusher sleeps this long when there is nothing to write
+
+/**
+* Parses a log level name.
+*
+* @param name: "off", "summary" or "op".
+*
+* @returns the level, or -1 if the name is unknown.
+*/
+int logLevelParse(const char *name) {
+	const char *names[] = {"off", "summary", "op"};
+	for (int level = LOG_OFF; level <= LOG_OP; level++) {
+		if (strcmp(name, names[level]) == 0) {
+			return level;
+		}
+	}
+	return -1;
+}
+
+/**
+* Writes out what the writers of the rings have added so far.
+*
+* @returns the number of bytes written.
+*/
+static long logFlushRings(log_flusher *flusher) {
+	long flushed = 0;
+	for (int i = 0; i < flusher->ring_count; i++) {
+		log_ring *ring = &flusher->rings[i];
+		long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		long tail = ring->tail;
+		while (tail < head) {
+			// The text may wrap around the end of the buffer.
+			long start = tail % ring->size;
+			long length = head - tail < ring->size - start ? head - tail : ring->size - start;
+			fwrite(ring->buffer + start, 1, length, flusher->output);
+			tail += length;
+			flushed += length;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	return flushed;
+}
+
+/**
+* Keeps flushing the rings until told to stop.
+*/
+static void *logFlusherThread(void *args) {
+	log_flusher *flusher = (log_flusher *)args;
+	struct timespec interval = {0, LOG_FLUSH_INTERVAL_NS};
+	while (!__atomic_load_n(&flusher->stop, __ATOMIC_ACQUIRE)) {
+		if (logFlushRings(flusher) == 0) {
+			fflush(flusher->output);
+			nanosleep(&interval, NULL);
+		}
+	}
+	logFlushRings(flusher);
+	fflush(flusher->output);
+	return NULL;
+}
+
+/**
+* Creates the log rings and starts the flusher thread.
+*
+* @param flusher: the flusher to start.
+* @param ring_count: the number of rings, one per writing thread.
+* @param ring_size: the bytes of each ring.
+* @param output: where the text goes, e.g. stdout.
+*/
+void logStart(log_flusher *flusher, int ring_count, long ring_size, FILE *output) {
+	if (ring_size < LOG_LINE_MAX) {
+		ring_size = LOG_LINE_MAX;
+	}
+	// sizeof(log_ring) is a multiple of the cache line, as aligned_alloc needs
+	flusher->rings = aligned_alloc(CACHE_LINE_SIZE, ring_count * sizeof(log_ring));
+	if (flusher->rings == NULL) {
+		perror("Log rings alloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(flusher->rings, 0, ring_count * sizeof(log_ring));
+	flusher->ring_count = ring_count;
+	flusher->output = output;
+	flusher->stop = 0;
+	for (int i = 0; i < ring_count; i++) {
+		flusher->rings[i].buffer = malloc(ring_size);
+		if (flusher->rings[i].buffer == NULL) {
+			perror("Log ring alloc failed");
+			exit(EXIT_FAILURE);
+		}
+		flusher->rings[i].size = ring_size;
+	}
+	if (pthread_create(&flusher->thread, NULL, logFlusherThread, flusher) != 0) {
+		perror("Log flusher create failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+* Adds a formatted line to a log ring, waiting for the flusher
+* only if the ring is full. Must only be called by the ring's thread.
+*
+* @param ring: the ring of the calling thread.
+* @param format: a printf format.
+*/
+void logWrite(log_ring *ring, const char *format, ...) {
+	char line[LOG_LINE_MAX];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length >= (int)sizeof(line)) {
+		length = sizeof(line) - 1;
+	}
+
+	long head = ring->head;
+	while (ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < length) {
+		sched_yield(); // full, let the flusher catch up
+	}
+	long start = head % ring->size;
+	long first = length < ring->size - start ? length : ring->size - start;
+	memcpy(ring->buffer + start, line, first);
+	memcpy(ring->buffer, line + first, length - first); // the part wrapping around
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+/**
+* Flushes what is left in the rings, stops the flusher thread
+* and frees the rings.
+*
+* @param flusher: the flusher to stop.
+*/
+void logStop(log_flusher *flusher) {
+	__atomic_store_n(&flusher->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(flusher->thread, NULL);
+	for (int i = 0; i < flusher->ring_count; i++) {
+		free(flusher->rings[i].buffer);
+	}
+	free(flusher->rings);
+}
+
+// A CPU and where it sits in the machine, for sorting the placements.
+typedef struct {
+	int cpu;
+	int package;
+	int core;
+	int sibling; // position of the CPU within its core, its hyperthread
+	int core_rank; // position of the core within its package
+} cpu_topology;
+
+/**
+* Reads a number from a topology file of a CPU, or -1 if there is none.
+*/
+static int readCpuTopology(int cpu, const char *name) {
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	FILE *file = fopen(path, "r");
+	int value = -1;
+	if (file != NULL) {
+		if (fscanf(file, "%d", &value) != 1) {
+			value = -1;
+		}
+		fclose(file);
+	}
+	return value;
+}
+
+static int compareCompact(const void *a, const void *b) {
+	const cpu_topology *x = a, *y = b;
+	if (x->package != y->package) {
+		return x->package - y->package;
+	}
+	if (x->core != y->core) {
+		return x->core - y->core;
+	}
+	return x->cpu - y->cpu;
+}
+
+// The first hyperthread of every core comes before any second one, and
+// within that the packages take turns, so consecutive threads get
+// different packages, then different cores, and share a core last.
+static int compareScatter(const void *a, const void *b) {
+	const cpu_topology *x = a, *y = b;
+	if (x->sibling != y->sibling) {
+		return x->sibling - y->sibling;
+	}
+	if (x->core_rank != y->core_rank) {
+		return x->core_rank - y->core_rank;
+	}
+	return x->package - y->package;
+}
+
+/**
+* Builds a placement over the CPUs this process may run on, using the
+* topology in /sys/devices/system/cpu.
+*
+* @param placement: the placement to fill in.
+* @param spec: "none", "compact" (consecutive threads on the same core,
+* then the same package, so ring neighbours share caches), "scatter"
+* (consecutive threads on different packages, then different cores,
+* sharing a core only once every core has a thread)
+* or a CPU list such as "0,2,8-11".
+*
+* @returns 0, or -1 if the spec is invalid or names a CPU which is
+* not available.
+*/
+int placementParse(cpu_placement *placement, const char *spec) {
+	placement->cpus = NULL;
+	placement->cpu_count = 0;
+	if (strcmp(spec, "none") == 0) {
+		return 0;
+	}
+
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		perror("sched_getaffinity failed");
+		return -1;
+	}
+	placement->cpus = malloc(CPU_SETSIZE * sizeof(int));
+
+	if (strcmp(spec, "compact") != 0 && strcmp(spec, "scatter") != 0) {
+		// An explicit list of CPUs and ranges, in the given order
+		const char *next = spec;
+		int valid = 1;
+		while (valid) {
+			char *end;
+			long first = strtol(next, &end, 10);
+			long last = first;
+			valid = end != next;
+			if (valid && *end == '-') {
+				next = end + 1;
+				last = strtol(next, &end, 10);
+				valid = end != next;
+			}
+			for (long cpu = first; valid && cpu <= last; cpu++) {
+				valid = cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && placement->cpu_count < CPU_SETSIZE;
+				if (valid) {
+					placement->cpus[placement->cpu_count++] = cpu;
+				}
+			}
+			if (!valid || *end == '\0') {
+				break;
+			}
+			valid = *end == ',';
+			next = end + 1;
+		}
+		if (!valid || placement->cpu_count == 0) {
+			placementFree(placement);
+			return -1;
+		}
+		return 0;
+	}
+
+	cpu_topology *topology = malloc(CPU_SETSIZE * sizeof(cpu_topology));
+	int count = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed)) {
+			topology[count].cpu = cpu;
+			topology[count].package = readCpuTopology(cpu, "physical_package_id");
+			topology[count].core = readCpuTopology(cpu, "core_id");
+			count++;
+		}
+	}
+	qsort(topology, count, sizeof(cpu_topology), compareCompact);
+	for (int i = 0; i < count; i++) {
+		const cpu_topology *previous = i > 0 ? &topology[i - 1] : NULL;
+		int same_package = previous != NULL && topology[i].package == previous->package;
+		int same_core = same_package && topology[i].core == previous->core;
+		topology[i].sibling = same_core ? previous->sibling + 1 : 0;
+		topology[i].core_rank = same_core ? previous->core_rank : same_package ? previous->core_rank + 1 : 0;
+	}
+	if (strcmp(spec, "scatter") == 0) {
+		qsort(topology, count, sizeof(cpu_topology), compareScatter);
+	}
+	for (int i = 0; i < count; i++) {
+		placement->cpus[i] = topology[i].cpu;
+	}
+	placement->cpu_count = count;
+	free(topology);
+	return 0;
+}
+
+/**
+* Prepares the attributes of a thread so that it is created on its
+* CPU of the placement. The attributes must be destroyed after use.
+*
+* @param placement: the placement.
+* @param index: the index of the thread in the placement order.
+* @param attr: the attributes to initialize.
+*/
+void placementAttr(const cpu_placement *placement, int index, pthread_attr_t *attr) {
+	pthread_attr_init(attr);
+	if (placement->cpu_count == 0) {
+		return;
+	}
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(placement->cpus[index % placement->cpu_count], &cpus);
+	errno = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+	if (errno != 0) {
+		perror("pthread_attr_setaffinity_np failed");
+	}
+}
+
+/**
+* Frees the placement.
+*
+* @param placement: the placement.
+*/
+void placementFree(cpu_placement *placement) {
+	free(placement->cpus);
+	placement->cpus = NULL;
+	placement->cpu_count = 0;
+}
+
+/**
+* Returns the size of the default huge pages, from /proc/meminfo.
+*/
+static long hugePageSize(void) {
+	long kilobytes = 2048;
+	FILE *meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo != NULL) {
+		char line[128];
+		while (fgets(line, sizeof(line), meminfo) != NULL) {
+			if (sscanf(line, "Hugepagesize: %ld kB", &kilobytes) == 1) {
+				break;
+			}
+		}
+		fclose(meminfo);
+	}
+	return kilobytes * 1024;
+}
+
+/**
+* Opens an anonymous shared memory file, a memfd if the kernel has them
+* or else a shm_open object under a name unique to the process.
+*
+* @param huge: whether the file should be backed by huge pages.
+*
+* @returns the file descriptor, or -1 with errno set.
+*/
+static int sharedFileOpen(int huge) {
+	int fd = memfd_create("cs3103_region", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+	if (fd >= 0 || errno != ENOSYS || huge) {
+		return fd;
+	}
+	static int region_serial = 0;
+	char name[64];
+	snprintf(name, sizeof(name), "/cs3103_region_%d_%d", (int)getpid(), region_serial++);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		shm_unlink(name);
+	}
+	return fd;
+}
+
+/**
+* Maps a new zero filled shared region. Must be called before fork.
+*
+* @param region: the region to fill in.
+* @param size: the bytes needed.
+* @param use_huge_pages: try huge pages first, which cut the TLB misses
+* on big buffers, and fall back to normal pages if none are available.
+*
+* @returns 0, or -1 with errno set if the region cannot be mapped.
+*/
+int sharedRegionCreate(shared_region *region, long size, int use_huge_pages) {
+	for (int huge = use_huge_pages ? 1 : 0; huge >= 0; huge--) {
+		long page_size = huge ? hugePageSize() : sysconf(_SC_PAGESIZE);
+		long mapped_size = (size + page_size - 1) / page_size * page_size;
+		int fd = sharedFileOpen(huge);
+		if (fd < 0) {
+			continue;
+		}
+		void *base = MAP_FAILED;
+		if (ftruncate(fd, mapped_size) == 0) {
+			base = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED | (huge ? MAP_HUGETLB : 0), fd, 0);
+		}
+		int saved_errno = errno;
+		close(fd); // the mapping keeps the memory alive
+		errno = saved_errno;
+		if (base != MAP_FAILED) {
+			region->base = base;
+			region->size = mapped_size;
+			region->huge = huge;
+			return 0;
+		}
+	}
+	region->base = NULL;
+	region->size = 0;
+	region->huge = 0;
+	return -1;
+}
+
+/**
+* Initializes a semaphore inside a shared region so that it can be
+* used by all the processes sharing it.
+*
+* @param semaphore: the semaphore, somewhere in the region.
+* @param value: its initial value.
+*
+* @returns 0, or -1 with errno set.
+*/
+int sharedSemaphoreInit(sem_t *semaphore, unsigned int value) {
+	return sem_init(semaphore, 1, value);
+}
+
+/**
+* Unmaps a shared region. Each process unmaps its own mapping; the memory
+* is freed once the last one is gone. Semaphores in the region must be
+* destroyed first by the last process using them.
+*
+* @param region: the region.
+*/
+void sharedRegionDestroy(shared_region *region) {
+	if (region->base != NULL) {
+		munmap(region->base, region->size);
+	}
+	region->base = NULL;
+	region->size = 0;
+}
+
+/**
+* Returns the CLOCK_MONOTONIC time in nanoseconds.
+*/
+long traceClock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+* Creates the buffers of a trace, which starts at the current time.
+*
+* @param trace: the trace to start.
+* @param buffer_count: the number of buffers, one per thread.
+*/
+void traceStart(trace_log *trace, int buffer_count) {
+	// sizeof(trace_buffer) is a multiple of the cache line, as aligned_alloc needs
+	trace->buffers = aligned_alloc(CACHE_LINE_SIZE, buffer_count * sizeof(trace_buffer));
+	if (trace->buffers == NULL) {
+		perror("Trace buffers alloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(trace->buffers, 0, buffer_count * sizeof(trace_buffer));
+	trace->buffer_count = buffer_count;
+	for (int i = 0; i < buffer_count; i++) {
+		snprintf(trace->buffers[i].name, sizeof(trace->buffers[i].name), "Thread %d", i + 1);
+	}
+	trace->origin_ns = traceClock();
+}
+
+/**
+* Names the thread of a buffer.
+*
+* @param buffer: the buffer.
+* @param format: a printf format.
+*/
+void traceName(trace_buffer *buffer, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer->name, sizeof(buffer->name), format, args);
+	va_end(args);
+}
+
+/**
+* Adds a span to a buffer. Must only be called by the buffer's thread.
+* Once the buffer holds TRACE_MAX_SPANS spans, the span is only counted
+* as dropped.
+*
+* @param buffer: the buffer of the calling thread.
+* @param name: what the thread was doing.
+* @param start_ns: when it started, from traceClock.
+* @param end_ns: when it ended, from traceClock.
+*/
+void traceSpan(trace_buffer *buffer, const char *name, long start_ns, long end_ns) {
+	if (buffer->count == TRACE_MAX_SPANS) {
+		buffer->dropped++;
+		return;
+	}
+	if (buffer->count == buffer->capacity) {
+		buffer->capacity = buffer->capacity > 0 ? 2 * buffer->capacity : 1024;
+		if (buffer->capacity > TRACE_MAX_SPANS) {
+			buffer->capacity = TRACE_MAX_SPANS;
+		}
+		buffer->spans = realloc(buffer->spans, buffer->capacity * sizeof(trace_span));
+		if (buffer->spans == NULL) {
+			perror("Trace buffer realloc failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	buffer->spans[buffer->count++] = (trace_span){name, start_ns, end_ns};
+}
+
+/**
+* Writes the trace as Chrome trace event JSON, after the threads are done.
+* Tells stderr how many spans each buffer dropped, if any.
+*
+* @param trace: the trace.
+* @param path: the file to write, or "-" for stdout.
+*
+* @returns 0, or -1 with errno set if the file cannot be opened.
+*/
+int traceWrite(const trace_log *trace, const char *path) {
+	FILE *output = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	if (output == NULL) {
+		return -1;
+	}
+	// Complete events ("X") with microsecond times, plus a name for each thread
+	fprintf(output, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	const char *separator = "\n";
+	for (int i = 0; i < trace->buffer_count; i++) {
+		const trace_buffer *buffer = &trace->buffers[i];
+		fprintf(output, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+			separator, i + 1, buffer->name);
+		separator = ",\n";
+		if (buffer->dropped > 0) {
+			fprintf(stderr, "Trace: %s dropped %ld spans after the first %ld\n", buffer->name, buffer->dropped, TRACE_MAX_SPANS);
+		}
+		for (long j = 0; j < buffer->count; j++) {
+			const trace_span *span = &buffer->spans[j];
+			fprintf(output, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				span->name, i + 1, (span->start_ns - trace->origin_ns) / 1e3, (span->end_ns - span->start_ns) / 1e3);
+		}
+	}
+	fprintf(output, "\n]}\n");
+	if (output != stdout) {
+		fclose(output);
+	} else {
+		fflush(output);
+	}
+	return 0;
+}
+
+/**
+* Frees the buffers of a trace.
+*
+* @param trace: the trace.
+*/
+void traceFree(trace_log *trace) {
+	for (int i = 0; i < trace->buffer_count; i++) {
+		free(trace->buffers[i].spans);
+	}
+	free(trace->buffers);
+	trace->buffers = NULL;
+	trace->buffer_count = 0;
+}
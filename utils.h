@@ -1,3 +1,75 @@
+#include <pthread.h>
+#include <semaphore.h>
+
+#define CACHE_LINE_SIZE 64 // bytes, data written by different threads is kept this far apart
+
+/**
+* Keeps the state of a word count which is fed in chunks.
+* A word split between two chunks is only counted once, so
+* feeding a text in any number of chunks gives the same result
+* as counting it in one pass.
+*/
+typedef struct {
+	long words;           // words started so far
+	int in_word;          // the last char fed was part of a word
+	int min_long_length;  // words at least this long are long words, 0 to skip them
+	long word_length;     // chars of the current word seen so far
+	long long_words;      // long words ended so far
+} word_counter;
+
+/**
+* Prepares a word counter for a new text.
+*
+* @param counter: the counter to reset.
+* @param min_long_length: also count the words with at least this
+* many chars in counter->long_words, or 0 to only count words.
+*/
+void wordCounterInit(word_counter *counter, int min_long_length);
+
+/**
+* Feeds the next <length> chars of the text to the counter.
+* Words are separated by spaces and newline characters.
+*
+* @param counter: the counter of the text.
+* @param text: the next chars of the text, no null terminator needed.
+* @param length: the number of chars to feed.
+*/
+void wordCounterFeed(word_counter *counter, const char *text, long length);
+
+/**
+* Moves the counter over chars without counting them, so that it is
+* in the right state for the chars that follow. Lets a text be cut
+* into chunks which are counted separately (e.g. in parallel) and
+* then summed: each chunk starts from the state of the one before.
+*
+* @param counter: the counter of the text.
+* @param text: the chars to skip, no null terminator needed.
+* @param length: the number of chars to skip.
+*/
+void wordCounterSkip(word_counter *counter, const char *text, long length);
+
+/**
+* Ends the text, which also ends its last word. The total number
+* of long words is in counter->long_words afterwards.
+* The counter can be fed again after wordCounterInit.
+*
+* @param counter: the counter of the text.
+*
+* @returns the total number of words in the text.
+*/
+long wordCounterFinish(word_counter *counter);
+
+/**
+* Chooses the kernel used by wordCounterFeed. By default the
+* fastest one the CPU supports is picked on first use.
+*
+* @param name: "scalar", "sse2", "avx2", or NULL for the default.
+*
+* @returns the name of the kernel in use, or NULL if the requested
+* kernel is unknown or not supported by this CPU.
+*/
+const char *wordCounterKernel(const char *name);
+
 /**
 * Counts the words in the string in a simple manner.
 * The counting is done by looking for spaces and newline 
@@ -9,6 +81,30 @@
 */
 int wordCount(char *text);
 
+/**
+* Counts the words in the first <length> chars of a buffer
+* which does not have to be null terminated, e.g. a file
+* mapped into memory. Uses the same rules as wordCount.
+*
+* @param text: the buffer to count the words in.
+* @param length: the number of chars in the buffer.
+* 
+* @returns the total number of words in the buffer.
+*/
+int wordCountRange(const char *text, long length);
+
+/**
+* Counts the words with at least <min_length> chars in the first
+* <length> chars of a buffer, in place and in a single pass.
+*
+* @param text: the buffer to count the long words in.
+* @param length: the number of chars in the buffer.
+* @param min_length: the length from which a word is long.
+* 
+* @returns the number of long words in the buffer.
+*/
+int countLongWords(const char *text, long length, int min_length);
+
 /**
 * Checks if the <input_file> is a txt file or not
 * by looking for '.txt' at the end.
@@ -39,4 +135,267 @@ long fileLength(FILE *file);
  * @param result: The value with int type to be kept.
  */
 
-void saveResult(char *fileName, int result);
\ No newline at end of file
+void saveResult(char *fileName, int result);
+
+/**
+ * Saves a result given as a string to a given textfile,
+ * e.g. a number with too many digits for an int.
+ * 
+ * @param fileName: The textfile name to save the result.
+ * 
+ * @param result: The string to be kept.
+ */
+void saveResultString(char *fileName, const char *result);
+
+/**
+* Parses a whole decimal number which fits an int, for the options
+* of the programs.
+*
+* @param text: the number.
+* @param value: set to the number, unchanged if it is invalid.
+*
+* @returns 0, or -1 if the text is not a number or out of range.
+*/
+int parseNumber(const char *text, int *value);
+
+/**
+* How much a program logs, from nothing to one line per operation.
+*/
+typedef enum {
+	LOG_OFF,     // nothing
+	LOG_SUMMARY, // a few lines per thread
+	LOG_OP       // a line per operation
+} log_level;
+
+/**
+* A buffer of log text written by one thread and emptied by the
+* flusher thread, so the writer never takes a lock or waits on
+* the output unless the buffer is full. head and tail, and each
+* ring, have their own cache lines.
+*/
+typedef struct {
+	char *buffer;
+	long size;
+	long head __attribute__((aligned(CACHE_LINE_SIZE))); // total bytes written, only moved by the writer
+	long tail __attribute__((aligned(CACHE_LINE_SIZE))); // total bytes flushed, only moved by the flusher
+} __attribute__((aligned(CACHE_LINE_SIZE))) log_ring;
+
+/**
+* A thread which writes the text of a set of log rings to an output.
+*/
+typedef struct {
+	log_ring *rings;
+	int ring_count;
+	FILE *output;
+	int stop;
+	pthread_t thread;
+} log_flusher;
+
+/**
+* Parses a log level name.
+*
+* @param name: "off", "summary" or "op".
+*
+* @returns the level, or -1 if the name is unknown.
+*/
+int logLevelParse(const char *name);
+
+/**
+* Creates the log rings and starts the flusher thread.
+*
+* @param flusher: the flusher to start.
+* @param ring_count: the number of rings, one per writing thread.
+* @param ring_size: the bytes of each ring.
+* @param output: where the text goes, e.g. stdout.
+*/
+void logStart(log_flusher *flusher, int ring_count, long ring_size, FILE *output);
+
+/**
+* Adds a formatted line to a log ring, waiting for the flusher
+* only if the ring is full. Must only be called by the ring's thread.
+*
+* @param ring: the ring of the calling thread.
+* @param format: a printf format.
+*/
+void logWrite(log_ring *ring, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+* Flushes what is left in the rings, stops the flusher thread
+* and frees the rings.
+*
+* @param flusher: the flusher to stop.
+*/
+void logStop(log_flusher *flusher);
+
+/**
+* Where threads are pinned. The CPUs are listed in the order threads
+* take them: thread i runs on cpus[i % cpu_count].
+*/
+typedef struct {
+	int *cpus;     // NULL if threads are not pinned
+	int cpu_count;
+} cpu_placement;
+
+/**
+* Builds a placement over the CPUs this process may run on, using the
+* topology in /sys/devices/system/cpu.
+*
+* @param placement: the placement to fill in.
+* @param spec: "none", "compact" (consecutive threads on the same core,
+* then the same package, so ring neighbours share caches), "scatter"
+* (consecutive threads on different packages, then different cores,
+* sharing a core only once every core has a thread)
+* or a CPU list such as "0,2,8-11".
+*
+* @returns 0, or -1 if the spec is invalid or names a CPU which is
+* not available.
+*/
+int placementParse(cpu_placement *placement, const char *spec);
+
+/**
+* Prepares the attributes of a thread so that it is created on its
+* CPU of the placement. The attributes must be destroyed after use.
+*
+* @param placement: the placement.
+* @param index: the index of the thread in the placement order.
+* @param attr: the attributes to initialize.
+*/
+void placementAttr(const cpu_placement *placement, int index, pthread_attr_t *attr);
+
+/**
+* Frees the placement.
+*
+* @param placement: the placement.
+*/
+void placementFree(cpu_placement *placement);
+
+/**
+* A block of memory shared between a process and the children it forks.
+* It is backed by a memfd, or by a shm_open object with a name unique to
+* the process when memfd is unavailable, which is unlinked right away, so
+* instances running side by side never collide and nothing is left
+* behind if a process dies.
+*/
+typedef struct {
+	void *base;
+	long size;    // bytes mapped, a multiple of the page size in use
+	int huge;     // whether the region is backed by huge pages
+} shared_region;
+
+/**
+* Maps a new zero filled shared region. Must be called before fork.
+*
+* @param region: the region to fill in.
+* @param size: the bytes needed.
+* @param use_huge_pages: try huge pages first, which cut the TLB misses
+* on big buffers, and fall back to normal pages if none are available.
+*
+* @returns 0, or -1 with errno set if the region cannot be mapped.
+*/
+int sharedRegionCreate(shared_region *region, long size, int use_huge_pages);
+
+/**
+* Initializes a semaphore inside a shared region so that it can be
+* used by all the processes sharing it.
+*
+* @param semaphore: the semaphore, somewhere in the region.
+* @param value: its initial value.
+*
+* @returns 0, or -1 with errno set.
+*/
+int sharedSemaphoreInit(sem_t *semaphore, unsigned int value);
+
+/**
+* Unmaps a shared region. Each process unmaps its own mapping; the memory
+* is freed once the last one is gone. Semaphores in the region must be
+* destroyed first by the last process using them.
+*
+* @param region: the region.
+*/
+void sharedRegionDestroy(shared_region *region);
+
+/**
+* A span of time a thread spent on something, in CLOCK_MONOTONIC
+* nanoseconds as returned by traceClock.
+*/
+typedef struct {
+	const char *name; // must outlive the trace, e.g. a string literal
+	long start_ns;
+	long end_ns;
+} trace_span;
+
+// The most spans a buffer keeps, 24 MiB of them; later spans are dropped
+#define TRACE_MAX_SPANS (1L << 20)
+
+/**
+* The spans of one thread. Only that thread adds to it, so recording
+* a span takes no lock. Each buffer has its own cache line.
+*/
+typedef struct {
+	trace_span *spans;
+	long count;
+	long capacity;
+	long dropped; // spans not kept, once count reached TRACE_MAX_SPANS
+	char name[32]; // shown as the name of the thread
+} __attribute__((aligned(CACHE_LINE_SIZE))) trace_buffer;
+
+/**
+* A timeline of spans over a set of threads, written in the Chrome
+* trace event format which chrome://tracing and Perfetto open.
+*/
+typedef struct {
+	trace_buffer *buffers;
+	int buffer_count;
+	long origin_ns; // the time the trace starts at
+} trace_log;
+
+/**
+* Returns the CLOCK_MONOTONIC time in nanoseconds.
+*/
+long traceClock(void);
+
+/**
+* Creates the buffers of a trace, which starts at the current time.
+*
+* @param trace: the trace to start.
+* @param buffer_count: the number of buffers, one per thread.
+*/
+void traceStart(trace_log *trace, int buffer_count);
+
+/**
+* Names the thread of a buffer.
+*
+* @param buffer: the buffer.
+* @param format: a printf format.
+*/
+void traceName(trace_buffer *buffer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+* Adds a span to a buffer. Must only be called by the buffer's thread.
+* Once the buffer holds TRACE_MAX_SPANS spans, the span is only counted
+* as dropped.
+*
+* @param buffer: the buffer of the calling thread.
+* @param name: what the thread was doing.
+* @param start_ns: when it started, from traceClock.
+* @param end_ns: when it ended, from traceClock.
+*/
+void traceSpan(trace_buffer *buffer, const char *name, long start_ns, long end_ns);
+
+/**
+* Writes the trace as Chrome trace event JSON, after the threads are done.
+* Tells stderr how many spans each buffer dropped, if any.
+*
+* @param trace: the trace.
+* @param path: the file to write, or "-" for stdout.
+*
+* @returns 0, or -1 with errno set if the file cannot be opened.
+*/
+int traceWrite(const trace_log *trace, const char *path);
+
+/**
+* Frees the buffers of a trace.
+*
+* @param trace: the trace.
+*/
+void traceFree(trace_log *trace);
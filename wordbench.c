@@ -0,0 +1,569 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "utils.h"
+
+#define LONG_WORD_LENGTH 6 // problem2's default for the math files
+#define LINE_WORDS 12 // Words per line in generated files
+#define CSV_HEADER "label,kernel,stage,repeat,files,bytes,seconds,mb_per_s,files_per_s\n"
+
+// Options of the corpus generator. Sizes and word lengths are
+// drawn between their min and max, sizes on a log scale so that
+// small files are as common as in a real source tree.
+typedef struct {
+	int file_count;
+	long min_size;
+	long max_size;
+	int depth; // deepest directory level below the root
+	int branching; // subdirectories per directory
+	int min_word_length;
+	int max_word_length;
+	int math_percent; // files named math*.txt, which problem2 counts long words in
+	unsigned long seed;
+} corpus_options;
+
+// A text file found by the traversal, loaded by the read stage.
+typedef struct {
+	char *path;
+	char *text; // null terminated
+	long size;
+	int is_math;
+} bench_file;
+
+typedef struct {
+	bench_file *files;
+	int count;
+	int capacity;
+	long bytes;
+} file_list;
+
+// The stage times problem2 writes with -S. Its stages overlap, so
+// each one is the time from its start to the end of the stage.
+typedef struct {
+	double walk; // the walkers are done
+	double read; // every file is in the ring
+	double count; // the workers are done
+} problem2_stats;
+
+/**
+ * @brief Writes a deterministic corpus of text files under a directory.
+ *
+ * @param options : The shape of the corpus.
+ * @param root : The directory to create the corpus in.
+ */
+void generateCorpus(const corpus_options *options, const char *root);
+
+/**
+ * @brief Runs every stage over a corpus and writes one CSV row per stage and repeat.
+ *
+ * @param root : The corpus directory.
+ * @param repeats : How many times each stage runs.
+ * @param label : Goes into the first column, e.g. the commit.
+ * @param problem2 : The problem2 binary to time end to end, NULL to skip it.
+ * @param csv : Where the rows go.
+ */
+void runBenchmark(const char *root, int repeats, const char *label, const char *problem2, FILE *csv);
+
+/**
+ * @brief Lists the text files under a directory, the ones problem2
+ * counts: ".txt" in the name.
+ *
+ * @param list : The list to add the files to.
+ * @param dir_fd : The directory, it is closed.
+ * @param dir_name : The directory path.
+ */
+void traverseCorpus(file_list *list, int dir_fd, const char *dir_name);
+
+/**
+ * @brief Reads every listed file into memory.
+ *
+ * @param list : The files to read.
+ */
+void loadCorpus(file_list *list);
+
+/**
+ * @brief Runs problem2 on the corpus with its output thrown away.
+ *
+ * @param problem2 : The binary.
+ * @param root : The corpus directory.
+ * @param stats : Set to the stage times problem2 reports.
+ * @return The result problem2 saved in p2_result.txt.
+ */
+long runProblem2(const char *problem2, const char *root, problem2_stats *stats);
+
+/**
+ * @brief Writes one CSV row.
+ *
+ * @param csv : The output.
+ * @param label : The run label.
+ * @param kernel : The word counting kernel in use.
+ * @param stage : The stage name.
+ * @param repeat : The repeat number.
+ * @param list : The corpus, for the file and byte counts.
+ * @param seconds : The time the stage took.
+ */
+void writeRow(FILE *csv, const char *label, const char *kernel, const char *stage, int repeat, const file_list *list, double seconds);
+
+/**
+ * @brief Returns the monotonic clock in seconds.
+ */
+double now(void);
+
+/**
+ * @brief Returns the next number of a xorshift64* generator, so
+ * the corpus is the same for a seed on every machine.
+ *
+ * @param state : The generator state, not 0.
+ */
+unsigned long nextRandom(unsigned long *state);
+
+/**
+ * @brief Parses "min:max" into two numbers, or "n" into n and n.
+ *
+ * @return 1 if the range was valid.
+ */
+int parseRange(const char *text, long *min, long *max);
+
+static void usage(const char *program) {
+	fprintf(stderr, "Usage: %s gen [-f files] [-s min_size:max_size] [-d depth] [-b branching] [-w min_len:max_len] [-p math_percent] [-r seed] <corpus_dir>\n", program);
+	fprintf(stderr, "       %s run [-n repeats] [-l label] [-x problem2] [-o csv_file] <corpus_dir>\n", program);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		usage(argv[0]);
+	}
+	int is_gen = strcmp(argv[1], "gen") == 0;
+	if (!is_gen && strcmp(argv[1], "run") != 0) {
+		usage(argv[0]);
+	}
+
+	corpus_options options = {1000, 64, 262144, 3, 4, 1, 12, 10, 1};
+	int repeats = 3;
+	const char *label = "";
+	const char *problem2 = "./problem2";
+	const char *csv_name = NULL;
+	long min, max;
+	int opt;
+
+	// Options come after the command
+	optind = 2;
+	while ((opt = getopt(argc, argv, is_gen ? "f:s:d:b:w:p:r:" : "n:l:x:o:")) != -1) {
+		switch (opt) {
+			case 'f':
+				options.file_count = atoi(optarg);
+				break;
+			case 's':
+				if (!parseRange(optarg, &options.min_size, &options.max_size) || options.min_size < 1) {
+					usage(argv[0]);
+				}
+				break;
+			case 'd':
+				options.depth = atoi(optarg);
+				break;
+			case 'b':
+				options.branching = atoi(optarg);
+				break;
+			case 'w':
+				if (!parseRange(optarg, &min, &max) || min < 1) {
+					usage(argv[0]);
+				}
+				options.min_word_length = min;
+				options.max_word_length = max;
+				break;
+			case 'p':
+				options.math_percent = atoi(optarg);
+				break;
+			case 'r':
+				options.seed = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				repeats = atoi(optarg);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			case 'x':
+				problem2 = strcmp(optarg, "none") == 0 ? NULL : optarg;
+				break;
+			case 'o':
+				csv_name = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || options.file_count < 0 || options.depth < 0 || options.branching < 1 || repeats < 1) {
+		usage(argv[0]);
+	}
+	if (options.seed == 0) {
+		options.seed = 1; // xorshift never leaves 0
+	}
+
+	if (is_gen) {
+		generateCorpus(&options, argv[optind]);
+		return 0;
+	}
+	if (problem2 != NULL && access(problem2, X_OK) != 0) {
+		fprintf(stderr, "%s is not executable, skipping the problem2 stage\n", problem2);
+		problem2 = NULL;
+	}
+
+	FILE *csv = stdout;
+	if (csv_name != NULL) {
+		// Rows are appended so runs of several commits end up in one file.
+		csv = fopen(csv_name, "a");
+		if (csv == NULL) {
+			perror("CSV open failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fseek(csv, 0, SEEK_END);
+	if (ftell(csv) <= 0) {
+		fprintf(csv, CSV_HEADER);
+	}
+	runBenchmark(argv[optind], repeats, label, problem2, csv);
+	if (csv != stdout) {
+		fclose(csv);
+	}
+	return 0;
+}
+
+/**
+ * @brief Writes a deterministic corpus of text files under a directory.
+ *
+ * @param options : The shape of the corpus.
+ * @param root : The directory to create the corpus in.
+ */
+void generateCorpus(const corpus_options *options, const char *root) {
+	unsigned long random_state = options->seed;
+	char path[PATH_MAX];
+	long total = 0;
+
+	if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+		perror("Directory create failed");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < options->file_count; ++i) {
+		// Pick a directory, creating the levels on the way down.
+		int length = snprintf(path, sizeof(path), "%s", root);
+		int depth = nextRandom(&random_state) % (options->depth + 1);
+		for (int level = 0; level < depth; ++level) {
+			length += snprintf(path + length, sizeof(path) - length, "/d%lu", nextRandom(&random_state) % options->branching);
+			if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+				perror("Directory create failed");
+				exit(EXIT_FAILURE);
+			}
+		}
+		int is_math = (int)(nextRandom(&random_state) % 100) < options->math_percent;
+		snprintf(path + length, sizeof(path) - length, "/%s%d.txt", is_math ? "math" : "file", i);
+
+		double scale = (double)(nextRandom(&random_state) % 1000000) / 1000000.0;
+		long size = (long)(options->min_size * pow((double)options->max_size / options->min_size, scale));
+
+		FILE *file = fopen(path, "w");
+		if (file == NULL) {
+			perror("File create failed");
+			exit(EXIT_FAILURE);
+		}
+		long written = 0;
+		int words = 0;
+		while (written < size) {
+			int word_length = options->min_word_length + nextRandom(&random_state) % (options->max_word_length - options->min_word_length + 1);
+			for (int c = 0; c < word_length && written < size; ++c, ++written) {
+				fputc('a' + nextRandom(&random_state) % 26, file);
+			}
+			if (written < size) {
+				fputc(++words % LINE_WORDS == 0 ? '\n' : ' ', file);
+				written++;
+			}
+		}
+		fclose(file);
+		total += size;
+	}
+
+	printf("Generated %d files, %ld bytes in %s\n", options->file_count, total, root);
+}
+
+/**
+ * @brief Runs every stage over a corpus and writes one CSV row per stage and repeat.
+ *
+ * @param root : The corpus directory.
+ * @param repeats : How many times each stage runs.
+ * @param label : Goes into the first column, e.g. the commit.
+ * @param problem2 : The problem2 binary to time end to end, NULL to skip it.
+ * @param csv : Where the rows go.
+ */
+void runBenchmark(const char *root, int repeats, const char *label, const char *problem2, FILE *csv) {
+	file_list list = {NULL, 0, 0, 0};
+	double start;
+	// The kernel is chosen once here, so every row names the one the stages use
+	const char *kernel = wordCounterKernel(NULL);
+
+	int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (root_fd < 0) {
+		perror("Directory open failed");
+		exit(EXIT_FAILURE);
+	}
+	traverseCorpus(&list, root_fd, root);
+
+	for (int repeat = 0; repeat < repeats; ++repeat) {
+		// The files are read again each time, the last texts are kept.
+		for (int i = 0; i < list.count; ++i) {
+			free(list.files[i].text);
+		}
+		list.bytes = 0;
+		start = now();
+		loadCorpus(&list);
+		writeRow(csv, label, kernel, "read", repeat, &list, now() - start);
+	}
+
+	long words = 0;
+	for (int repeat = 0; repeat < repeats; ++repeat) {
+		words = 0;
+		start = now();
+		for (int i = 0; i < list.count; ++i) {
+			words += wordCount(list.files[i].text);
+		}
+		writeRow(csv, label, kernel, "wordCount", repeat, &list, now() - start);
+	}
+
+	long long_words = 0;
+	for (int repeat = 0; repeat < repeats; ++repeat) {
+		long_words = 0;
+		start = now();
+		for (int i = 0; i < list.count; ++i) {
+			long_words += countLongWords(list.files[i].text, list.files[i].size, LONG_WORD_LENGTH);
+		}
+		writeRow(csv, label, kernel, "countLongWords", repeat, &list, now() - start);
+	}
+
+	// What problem2 should report, to check its result against.
+	long expected_result = 0;
+	for (int i = 0; i < list.count; ++i) {
+		expected_result += list.files[i].is_math
+			? countLongWords(list.files[i].text, list.files[i].size, LONG_WORD_LENGTH)
+			: wordCount(list.files[i].text);
+	}
+	fprintf(stderr, "%d files, %ld bytes, %ld words, %ld long words, problem2 result should be %ld\n",
+		list.count, list.bytes, words, long_words, expected_result);
+
+	// The traversal and the handoff to the workers are timed by problem2 itself,
+	// so the rows follow its code from commit to commit.
+	for (int repeat = 0; problem2 != NULL && repeat < repeats; ++repeat) {
+		problem2_stats stats;
+		start = now();
+		long result = runProblem2(problem2, root, &stats);
+		double seconds = now() - start;
+		if (result != expected_result) {
+			fprintf(stderr, "%s counted %ld, expected %ld\n", problem2, result, expected_result);
+			exit(EXIT_FAILURE);
+		}
+		writeRow(csv, label, kernel, "traverseDir", repeat, &list, stats.walk);
+		writeRow(csv, label, kernel, "handoff", repeat, &list, stats.read);
+		writeRow(csv, label, kernel, "problem2", repeat, &list, seconds);
+	}
+
+	for (int i = 0; i < list.count; ++i) {
+		free(list.files[i].path);
+		free(list.files[i].text);
+	}
+	free(list.files);
+}
+
+/**
+ * @brief Lists the text files under a directory, the ones problem2
+ * counts: ".txt" in the name.
+ *
+ * @param list : The list to add the files to.
+ * @param dir_fd : The directory, it is closed.
+ * @param dir_name : The directory path.
+ */
+void traverseCorpus(file_list *list, int dir_fd, const char *dir_name) {
+	DIR *dir = fdopendir(dir_fd);
+	if (dir == NULL) {
+		perror("Directory open failed");
+		close(dir_fd);
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		int type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+		if (type == DT_DIR) {
+			int sub_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY);
+			if (sub_fd >= 0) {
+				traverseCorpus(list, sub_fd, path);
+			}
+		} else if (type == DT_REG && strstr(entry->d_name, ".txt") != NULL) {
+			if (list->count == list->capacity) {
+				list->capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+				list->files = realloc(list->files, list->capacity * sizeof(bench_file));
+			}
+			bench_file *file = &list->files[list->count++];
+			file->path = strdup(path);
+			file->text = NULL;
+			file->size = 0;
+			file->is_math = strstr(path, "math") != NULL;
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * @brief Reads every listed file into memory.
+ *
+ * @param list : The files to read.
+ */
+void loadCorpus(file_list *list) {
+	for (int i = 0; i < list->count; ++i) {
+		bench_file *file = &list->files[i];
+		FILE *input = fopen(file->path, "r");
+		if (input == NULL) {
+			perror("File open failed");
+			exit(EXIT_FAILURE);
+		}
+		file->size = fileLength(input);
+		file->text = malloc(file->size + 1);
+		file->size = fread(file->text, 1, file->size, input);
+		file->text[file->size] = '\0';
+		fclose(input);
+		list->bytes += file->size;
+	}
+}
+
+/**
+ * @brief Runs problem2 on the corpus with its output thrown away.
+ *
+ * @param problem2 : The binary.
+ * @param root : The corpus directory.
+ * @param stats : Set to the stage times problem2 reports.
+ * @return The result problem2 saved in p2_result.txt.
+ */
+long runProblem2(const char *problem2, const char *root, problem2_stats *stats) {
+	char stats_name[] = "/tmp/wordbench_stats_XXXXXX";
+	int stats_fd = mkstemp(stats_name);
+	if (stats_fd < 0) {
+		perror("Stats file create failed");
+		exit(EXIT_FAILURE);
+	}
+	close(stats_fd);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork failed");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(problem2, problem2, "-S", stats_name, root, (char *)NULL);
+		perror("problem2 exec failed");
+		exit(EXIT_FAILURE);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", problem2);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *input = fopen(stats_name, "r");
+	if (input == NULL || fscanf(input, "walk %lf read %lf count %lf", &stats->walk, &stats->read, &stats->count) != 3) {
+		fprintf(stderr, "%s did not write its stage times\n", problem2);
+		exit(EXIT_FAILURE);
+	}
+	fclose(input);
+	unlink(stats_name);
+
+	long result;
+	input = fopen("p2_result.txt", "r");
+	if (input == NULL || fscanf(input, "%ld", &result) != 1) {
+		fprintf(stderr, "%s did not write p2_result.txt\n", problem2);
+		exit(EXIT_FAILURE);
+	}
+	fclose(input);
+	return result;
+}
+
+/**
+ * @brief Writes one CSV row.
+ *
+ * @param csv : The output.
+ * @param label : The run label.
+ * @param kernel : The word counting kernel in use.
+ * @param stage : The stage name.
+ * @param repeat : The repeat number.
+ * @param list : The corpus, for the file and byte counts.
+ * @param seconds : The time the stage took.
+ */
+void writeRow(FILE *csv, const char *label, const char *kernel, const char *stage, int repeat, const file_list *list, double seconds) {
+	if (seconds <= 0) {
+		seconds = 1e-9;
+	}
+	fprintf(csv, "%s,%s,%s,%d,%d,%ld,%.6f,%.2f,%.2f\n", label, kernel, stage, repeat,
+		list->count, list->bytes, seconds, list->bytes / seconds / 1e6, list->count / seconds);
+	fflush(csv);
+}
+
+/**
+ * @brief Returns the monotonic clock in seconds.
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Returns the next number of a xorshift64* generator, so
+ * the corpus is the same for a seed on every machine.
+ *
+ * @param state : The generator state, not 0.
+ */
+unsigned long nextRandom(unsigned long *state) {
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DUL;
+}
+
+/**
+ * @brief Parses "min:max" into two numbers, or "n" into n and n.
+ *
+ * @return 1 if the range was valid.
+ */
+int parseRange(const char *text, long *min, long *max) {
+	char *end;
+	*min = strtol(text, &end, 10);
+	*max = *end == ':' ? strtol(end + 1, &end, 10) : *min;
+	return *end == '\0' && *min <= *max;
+}